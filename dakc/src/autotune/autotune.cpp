@@ -0,0 +1,425 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+
+#include <unistd.h>
+#include <mpi.h>
+
+#include "autotune.hpp"
+#include "kcounter.hpp"
+#include "ska_sort.hpp"
+
+#define ALLTOALL_REPS 5
+#define MIN_BUCKET_SIZE 1024
+#define MAX_BUCKET_SIZE (1ULL << 22)
+#define ESTIMATE_SEED 0x2545F4914F6CDD1DULL
+
+/* bytes of a k-mer in the counter (see kmer_traits) */
+static uint64_t kmer_bytes(int k) {
+  if (k <= 32) return 8;
+  if (k <= 64) return 16;
+  return 8 * ((2 * k + 63) / 64);
+}
+
+static uint64_t sysfs_cache_bytes(int level) {
+/*
+ * Size of the level 'level' data (or unified) cache of cpu0 from sysfs,
+ * 0 if it can't be found.
+ */
+  for (int i = 0; i < 16; i++) {
+    std::string dir = "/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(i) + "/";
+    std::ifstream lvl(dir + "level"), type(dir + "type"), size(dir + "size");
+    if (!lvl || !type || !size) break;
+
+    int l;
+    std::string t, s;
+    lvl >> l;
+    type >> t;
+    size >> s;
+    if (l != level || t == "Instruction" || s.empty()) continue;
+
+    uint64_t bytes = strtoull(s.c_str(), NULL, 10);
+    if (s.back() == 'K') bytes <<= 10;
+    if (s.back() == 'M') bytes <<= 20;
+    return bytes;
+  }
+  return 0;
+}
+
+static uint64_t cache_bytes(int level, long sc_name, uint64_t fallback) {
+  long bytes = sysconf(sc_name);
+  if (bytes > 0) return bytes;
+
+  uint64_t sysfs = sysfs_cache_bytes(level);
+  return (sysfs > 0) ? sysfs : fallback;
+}
+
+static double stream_bandwidth() {
+/*
+ * Read bandwidth of this PE while all PEs stream their own array, as in
+ * microbenchmarks/membandwidth.cpp; the best of a few passes.
+ */
+  std::vector<uint64_t> array(AUTOTUNE_BW_BYTES / sizeof(uint64_t));
+  for (size_t i = 0; i < array.size(); i++) array[i] = i;
+
+  double best = 0;
+  volatile uint64_t sink;
+  for (int rep = 0; rep < 3; rep++) {
+    MPI_Barrier(MPI_COMM_WORLD);
+    double starttime = MPI_Wtime();
+    uint64_t sum = 0;
+    for (size_t i = 0; i < array.size(); i++) sum += array[i];
+    sink = sum;
+    double time = MPI_Wtime() - starttime;
+    best = std::max(best, array.size() * sizeof(uint64_t) / time);
+  }
+  (void)sink;
+  return best;
+}
+
+static double alltoall_time(std::vector<char> &sendbuf, std::vector<char> &recvbuf, int block, int npes) {
+  double best = 1e30;
+  for (int rep = 0; rep < ALLTOALL_REPS; rep++) {
+    MPI_Barrier(MPI_COMM_WORLD);
+    double starttime = MPI_Wtime();
+    MPI_Alltoall(sendbuf.data(), block, MPI_BYTE, recvbuf.data(), block, MPI_BYTE, MPI_COMM_WORLD);
+    best = std::min(best, MPI_Wtime() - starttime);
+  }
+
+  double slowest;
+  MPI_Allreduce(&best, &slowest, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+  return slowest;
+}
+
+static machine_params measure_machine() {
+  machine_params mp;
+  int rank, npes;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &npes);
+
+  /* caches: the smallest of all PEs, so that every PE fits */
+  uint64_t local[3] = {cache_bytes(2, _SC_LEVEL2_CACHE_SIZE, 1ULL << 20),
+                       cache_bytes(3, _SC_LEVEL3_CACHE_SIZE, 1ULL << 25),
+                       static_cast<uint64_t>(std::max(64L, sysconf(_SC_LEVEL1_DCACHE_LINESIZE)))};
+  uint64_t global[3];
+  MPI_Allreduce(local, global, 3, MPI_UINT64_T, MPI_MIN, MPI_COMM_WORLD);
+  mp.l2_bytes = global[0];
+  mp.l3_bytes = global[1];
+  mp.line_bytes = global[2];
+
+  /* the PEs of a node share its L3 */
+  MPI_Comm node;
+  int node_pes;
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+  MPI_Comm_size(node, &node_pes);
+  MPI_Comm_free(&node);
+  MPI_Allreduce(&node_pes, &mp.pes_per_node, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+  mp.cache_share = mp.l2_bytes + mp.l3_bytes / mp.pes_per_node;
+
+  double bw = stream_bandwidth();
+  MPI_Allreduce(&bw, &mp.mem_bw, 1, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+
+  /*
+   * An all-to-all of b bytes per PE pair takes (P - 1)(alpha + b / beta),
+   * two block sizes give both. A single PE only copies memory.
+   */
+  mp.alpha = 0;
+  mp.beta = mp.mem_bw;
+  if (npes > 1) {
+    const int small = 64;
+    const int large = static_cast<int>(std::max<uint64_t>(16 * small,
+                                       std::min<uint64_t>(1 << 16, AUTOTUNE_BW_BYTES / npes)));
+    std::vector<char> sendbuf(static_cast<size_t>(large) * npes, 1), recvbuf(sendbuf.size());
+
+    double tsmall = alltoall_time(sendbuf, recvbuf, small, npes) / (npes - 1);
+    double tlarge = alltoall_time(sendbuf, recvbuf, large, npes) / (npes - 1);
+    if (tlarge > tsmall) {
+      mp.beta = (large - small) / (tlarge - tsmall);
+      mp.alpha = std::max(0.0, tsmall - small / mp.beta);
+    }
+  }
+  return mp;
+}
+
+template<typename key_fn>
+static uint64_t for_each_kmer_key(const char* data, uint64_t len, int k, bool canonical, key_fn key) {
+/*
+ * Calls key(k-mer key) for every k-mer of the parsed sequences in data,
+ * until it returns false, and returns the position reached. K-mers are
+ * keyed by a rolling polynomial hash of their bases (and of their reverse
+ * complement), so any k fits in 64 bits.
+ */
+  const uint64_t B = 0x9E3779B97F4A7C15ULL; // odd, so B has an inverse mod 2^64
+  uint64_t Binv = B, Bk1 = 1;
+  for (int i = 0; i < 5; i++) Binv *= 2 - B * Binv; // Newton iteration
+  for (int i = 0; i < k - 1; i++) Bk1 *= B;
+  const uint64_t Bk = Bk1 * B;
+
+  uint64_t fwd = 0, rc = 0, pw = 1, run = 0;
+  for (uint64_t pos = 0; pos < len; pos++) {
+    uint8_t b = char2base(data[pos]);
+    if (b > 0x3) { // newline or N
+      fwd = rc = 0;
+      pw = 1;
+      run = 0;
+      continue;
+    }
+
+    /* digits 1..4, complement(b) == b ^ 3 */
+    uint64_t d = b + 1, dc = (b ^ 0x3) + 1;
+    run++;
+    if (run <= static_cast<uint64_t>(k)) {
+      fwd = fwd * B + d;
+      rc += dc * pw;
+      pw *= B;
+    } else {
+      uint8_t old = char2base(data[pos - k]);
+      fwd = fwd * B + d - (old + 1) * Bk;
+      rc = (rc - ((old ^ 0x3) + 1)) * Binv + dc * Bk1;
+    }
+    if (run < static_cast<uint64_t>(k)) continue;
+
+    if (!key(canonical ? std::min(fwd, rc) : fwd)) return pos + 1;
+  }
+  return len;
+}
+
+static void sample_input(fqreader &reader, int k, bool canonical, uint64_t bucket_size, input_sample &is) {
+/*
+ * Splits the k-mers of this PE's first window into C3 buffers, like
+ * read_till_buf_max, and counts the runs flush_buffer would send as heavy
+ * hitters.
+ */
+  char* data;
+  uint64_t len;
+  if (!reader.peek_window(data, len)) return;
+
+  std::vector<uint64_t> buf;
+  buf.reserve(bucket_size);
+
+  auto flush = [&]() {
+    double starttime = MPI_Wtime();
+    ska_sort(buf.begin(), buf.end());
+    is.sort_time += MPI_Wtime() - starttime;
+
+    for (size_t i = 0, j; i < buf.size(); i = j) {
+      for (j = i + 1; j < buf.size() && buf[j] == buf[i]; j++);
+      if (j - i >= 3) {
+        is.heavy_copies += j - i;
+        is.heavy_runs++;
+      }
+    }
+    is.kmers += buf.size();
+    buf.clear();
+  };
+
+  for_each_kmer_key(data, len, k, canonical, [&](uint64_t key) {
+    buf.push_back(key);
+    if (buf.size() < bucket_size) return true;
+    flush();
+    return is.kmers < AUTOTUNE_SAMPLE_BUFFERS * bucket_size;
+  });
+  if (!buf.empty()) flush();
+}
+
+void autotune(fqreader &reader, kcount_config &cfg) {
+  int rank, npes;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &npes);
+
+  double starttime = MPI_Wtime();
+  machine_params mp = measure_machine();
+  const uint64_t kb = kmer_bytes(cfg.kmer_len);
+
+  /* C3: half of the cache share, every parsing thread of a PE has its own buffer */
+  const uint64_t thread_share = mp.l2_bytes + mp.l3_bytes / (static_cast<uint64_t>(mp.pes_per_node) * cfg.threads);
+  uint64_t bucket_size = std::min<uint64_t>(MAX_BUCKET_SIZE,
+                         std::max<uint64_t>(MIN_BUCKET_SIZE, thread_share / (2 * kb)));
+
+  /* C2: the other half holds 2 x P packets */
+  int pkt_size = cfg.pkt_size;
+  std::vector<int> sizes = compiled_pkt_sizes(cfg.kmer_len);
+  if (!sizes.empty()) {
+    const double min_bytes = AUTOTUNE_AMORTIZE * mp.alpha * mp.beta;
+    const uint64_t max_bytes = mp.cache_share / (4 * npes);
+    auto pkt_bytes = [kb](int bigk) { return 2 * bigk * kb + 2 * sizeof(int); };
+
+    pkt_size = sizes.front();
+    for (int bigk : sizes) {
+      if (pkt_bytes(bigk) > max_bytes) break;
+      pkt_size = bigk;
+      if (pkt_bytes(bigk) >= min_bytes) break;
+    }
+  }
+
+  /* HITTER: from the repeats of the first buffers of every PE */
+  input_sample is;
+  sample_input(reader, cfg.kmer_len, cfg.canonical, bucket_size, is);
+
+  uint64_t local[3] = {is.kmers, is.heavy_copies, is.heavy_runs}, global[3];
+  double sort_time;
+  MPI_Allreduce(local, global, 3, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+  MPI_Allreduce(&is.sort_time, &sort_time, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+
+  /*
+   * per k-mer: the sender sorts it; a heavy run of c copies goes out as one
+   * (k-mer, count) entry instead of c k-mers, which saves their share of
+   * packet latency and bytes and their receiver sort work
+   */
+  double sort_per_kmer = 0, saved_per_kmer = 0;
+  if (global[0] > 0) {
+    const double normal_cap = 2 * pkt_size;
+    const double heavy_cap = (normal_cap * kb) / (kb + sizeof(count_t));
+    const double wire_copy = mp.alpha / normal_cap + kb / mp.beta;
+    const double wire_run = mp.alpha / heavy_cap + (kb + sizeof(count_t)) / mp.beta;
+
+    sort_per_kmer = sort_time / global[0] * kb / sizeof(uint64_t);
+    saved_per_kmer = (global[1] * (wire_copy + sort_per_kmer) - global[2] * (wire_run + sort_per_kmer)) / global[0];
+  }
+  bool hitter = saved_per_kmer > sort_per_kmer;
+
+  /* rank 0 decides, every PE must run the same specialization */
+  uint64_t choice[3] = {bucket_size, static_cast<uint64_t>(pkt_size), hitter};
+  MPI_Bcast(choice, 3, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+  cfg.bucket_size = choice[0];
+  cfg.pkt_size = static_cast<int>(choice[1]);
+  cfg.hitter = (choice[2] != 0);
+
+  double time = MPI_Wtime() - starttime, globaltime;
+  MPI_Reduce(&time, &globaltime, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+  if (rank == 0) {
+    std::cout << "autotune: L2 " << mp.l2_bytes << " B, L3 " << mp.l3_bytes << " B, line "
+      << mp.line_bytes << " B, " << mp.pes_per_node << " PEs per node, cache share Z "
+      << mp.cache_share << " B per PE" << std::endl;
+    std::cout << "autotune: B_mem " << mp.mem_bw / 1e9 << " GB/s per PE, network alpha "
+      << mp.alpha * 1e6 << " us, beta " << mp.beta / 1e9 << " GB/s per PE" << std::endl;
+    std::cout << "autotune: " << global[0] << " k-mers sampled, "
+      << (global[0] ? 100.0 * global[1] / global[0] : 0.0) << "% in repeats of a C3 buffer, sort "
+      << sort_per_kmer * 1e9 << " ns vs. " << saved_per_kmer * 1e9 << " ns saved per k-mer" << std::endl;
+    std::cout << "autotune result (reuse on this machine): -b " << cfg.bucket_size << " -c "
+      << cfg.pkt_size << " -l " << cfg.hitter << std::endl;
+    std::cout << "autotune time: " << globaltime << " seconds" << std::endl;
+  }
+}
+
+/* HyperLogLog sketch of the distinct k-mers, 2^ESTIMATE_HLL_BITS registers */
+struct hll_sketch {
+  std::vector<uint8_t> reg;
+
+  hll_sketch() : reg(1ULL << ESTIMATE_HLL_BITS, 0) {}
+
+  /* the top bits of the hash pick a register, which keeps the longest run of leading zeros after them */
+  inline void add(uint64_t hash) {
+    const uint64_t rest = hash << ESTIMATE_HLL_BITS;
+    const uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - ESTIMATE_HLL_BITS + 1;
+    uint8_t &r = reg[hash >> (64 - ESTIMATE_HLL_BITS)];
+    if (rank > r) r = rank;
+  }
+
+  /* collective: the sketch of the k-mers of all PEs */
+  void merge() {
+    MPI_Allreduce(MPI_IN_PLACE, reg.data(), reg.size(), MPI_UINT8_T, MPI_MAX, MPI_COMM_WORLD);
+  }
+
+  /* with linear counting while registers are still empty */
+  double estimate() const {
+    const double m = reg.size();
+    double sum = 0;
+    uint64_t zeros = 0;
+    for (uint8_t r : reg) {
+      sum += std::ldexp(1.0, -r);
+      zeros += (r == 0);
+    }
+    const double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    return (e <= 2.5 * m && zeros > 0) ? m * std::log(m / zeros) : e;
+  }
+};
+
+void estimate_kmers(fqreader &reader, kcount_config &cfg, bool pick_receiver) {
+  int rank, npes;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &npes);
+  double starttime = MPI_Wtime();
+
+  /* the first half of every PE's sample and all of it */
+  hll_sketch half, full;
+  uint64_t local[3] = {0, 0, 0}; // k-mers in the first half, k-mers, input bytes sampled
+  char* data;
+  uint64_t len;
+  if (reader.peek_window(data, len) && len > 0) {
+    const uint64_t half_kmers = std::min<uint64_t>(ESTIMATE_SAMPLE_KMERS, len) / 2; // a window has fewer k-mers than bytes
+    const uint64_t pos = for_each_kmer_key(data, len, cfg.kmer_len, cfg.canonical, [&](uint64_t key) {
+      const uint64_t hash = MurmurHash64A(key, ESTIMATE_SEED);
+      if (local[1] < half_kmers) {
+        half.add(hash);
+        local[0]++;
+      }
+      full.add(hash);
+      return ++local[1] < ESTIMATE_SAMPLE_KMERS;
+    });
+    local[2] = reader.window_bytes * pos / len;
+  }
+
+  uint64_t global[3];
+  MPI_Allreduce(local, global, 3, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+  half.merge();
+  full.merge();
+
+  MPI_Offset filesize;
+  MPI_File_get_size(reader.inputfile, &filesize);
+  const double input_bytes = static_cast<double>(filesize) * (reader.is_gz ? ARENA_GZ_RATIO : 1);
+
+  /*
+   * The k-mers scale with the input bytes. The distinct k-mers follow
+   * Heaps' law, D(n) = a n^b, through the first half of the samples and
+   * all of them. b falls as the genome's k-mers saturate, so the exponent
+   * of the sample errs on the large side; no growth seen (b = 1) counts
+   * every further k-mer as new.
+   */
+  const double d_half = std::min<double>(half.estimate(), global[0]);
+  const double d_full = std::min<double>(full.estimate(), global[1]);
+  double kmers = 0, distinct = 0;
+  if (global[1] > 0 && global[2] > 0) {
+    kmers = std::max<double>(global[1], global[1] * input_bytes / global[2]);
+    double b = 1;
+    if (global[1] > global[0] && d_half > 0) {
+      b = std::min(1.0, std::max(0.0, std::log(d_full / d_half) / std::log(static_cast<double>(global[1]) / global[0])));
+    }
+    distinct = std::min(kmers, d_full * std::pow(kmers / global[1], b));
+  }
+  cfg.est_kmers = static_cast<uint64_t>(kmers / npes);
+  cfg.est_distinct = static_cast<uint64_t>(distinct / npes);
+
+  /*
+   * -r, unless given: a PE's round holds every copy with the sort backend,
+   * every distinct k-mer in a (k-mer, count) slot with the hash backend,
+   * whose table is between 3/8 and 3/4 full. The hash table is picked if
+   * it takes less memory and fits under its limit.
+   */
+  const uint64_t kb = kmer_bytes(cfg.kmer_len);
+  const double sort_bytes = static_cast<double>(cfg.est_kmers) / cfg.rounds * kb;
+  const double hash_bytes = 2.0 * cfg.est_distinct / cfg.rounds * (kb + sizeof(count_t));
+  const uint64_t table_max = cfg.mem_limit ? std::min<uint64_t>(RECV_TABLE_MAX_BYTES, cfg.mem_limit / 2) : RECV_TABLE_MAX_BYTES;
+  if (pick_receiver && global[1] > 0) {
+    cfg.receiver = (hash_bytes < sort_bytes && hash_bytes <= table_max) ? RECV_HASH : RECV_SORT;
+  }
+
+  double time = MPI_Wtime() - starttime, globaltime;
+  MPI_Reduce(&time, &globaltime, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+  if (rank == 0) {
+    std::cout << "estimate: " << global[1] << " k-mers sampled, " << static_cast<uint64_t>(d_full)
+      << " distinct (HyperLogLog, " << (1ULL << ESTIMATE_HLL_BITS) << " registers)" << std::endl;
+    std::cout << "estimate: " << static_cast<uint64_t>(kmers) << " k-mers, " << static_cast<uint64_t>(distinct)
+      << " distinct; per PE " << cfg.est_kmers << " k-mers, " << cfg.est_distinct << " distinct" << std::endl;
+    std::cout << "estimate: receiver memory per PE and round, sort " << sort_bytes / 1e6 << " MB, hash "
+      << hash_bytes / 1e6 << " MB -> -r " << (cfg.receiver == RECV_HASH ? "hash" : "sort")
+      << (pick_receiver ? "" : " (given)") << std::endl;
+    std::cout << "estimate time: " << globaltime << " seconds" << std::endl;
+  }
+}
@@ -0,0 +1,83 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <iostream>
+#include <vector>
+
+#include <mpi.h>
+
+#include "common.hpp"
+#include "fqreader.hpp"
+
+#ifndef AUTOTUNE_BW_BYTES
+#define AUTOTUNE_BW_BYTES (1ULL << 26) /* bytes a PE streams to measure B_mem */
+#endif
+
+#ifndef AUTOTUNE_SAMPLE_BUFFERS
+#define AUTOTUNE_SAMPLE_BUFFERS 8 /* C3 buffers of the first window sampled for repeats */
+#endif
+
+#ifndef ESTIMATE_SAMPLE_KMERS
+#define ESTIMATE_SAMPLE_KMERS (1ULL << 22) /* k-mers of the first window a PE feeds to the -e sketch */
+#endif
+
+#ifndef ESTIMATE_HLL_BITS
+#define ESTIMATE_HLL_BITS 14 /* 2^bits HyperLogLog registers, about 1.04 / 2^(bits/2) relative error */
+#endif
+
+#ifndef AUTOTUNE_AMORTIZE
+#define AUTOTUNE_AMORTIZE 8 /* a packet takes at least this many message latencies on the wire */
+#endif
+
+/*
+ * Machine parameters of the analytical model (analytical_model/models),
+ * as seen by one PE while all PEs run.
+ */
+typedef struct machine_params_type {
+    uint64_t l2_bytes = 0, l3_bytes = 0, line_bytes = 0;
+    int pes_per_node = 1;
+    uint64_t cache_share = 0; // Z: L2 plus this PE's share of L3
+    double mem_bw = 0;        // B_mem, bytes/s streamed by a PE
+    double alpha = 0;         // seconds per message
+    double beta = 0;          // bytes/s a PE sends through the network
+} machine_params;
+
+/* repeats of the sampled C3 buffers, as the L3 aggregation would see them */
+typedef struct input_sample_type {
+    uint64_t kmers = 0;
+    uint64_t heavy_copies = 0; // copies in runs of 3 or more (sent as HEAVY)
+    uint64_t heavy_runs = 0;
+    double sort_time = 0;      // seconds to sort the sampled buffers
+} input_sample;
+
+/*
+ * Collective: measures the machine (caches, memory bandwidth, network
+ * latency and bandwidth) and samples the first input window, then sets
+ * cfg.pkt_size (C2), cfg.bucket_size (C3) and cfg.hitter from the model:
+ *
+ *   - the C3 buffer takes half of the cache share Z, the 2 x P packets
+ *     of C2 k-mers (double buffered) the other half;
+ *   - C2 is the smallest compiled BIGKSIZE whose packet amortizes the
+ *     message latency, within that cache bound;
+ *   - HITTER is on if the bytes and receiver sort work saved by the
+ *     repeats of a buffer outweigh sorting the buffer.
+ *
+ * The choice is printed as flags, so it can be reused on the same machine
+ * without calibrating again. The window stays unconsumed.
+ */
+void autotune(fqreader &reader, kcount_config &cfg);
+
+/*
+ * Collective, -e: a cardinality pre-pass over the first ESTIMATE_SAMPLE_KMERS
+ * k-mers of every PE's first window. Their hashes go into a HyperLogLog
+ * sketch, merged over the PEs with an MPI_MAX reduction of the registers,
+ * and the total and distinct k-mers of the input are extrapolated from
+ * the sample (Heaps' law for the distinct ones). Sets cfg.est_kmers and
+ * cfg.est_distinct per PE, which presize the receive arrays, the -r hash
+ * table and the final table, and with pick_receiver (no -r given)
+ * cfg.receiver: the backend that takes less memory. The window stays
+ * unconsumed.
+ */
+void estimate_kmers(fqreader &reader, kcount_config &cfg, bool pick_receiver);
+
+#endif
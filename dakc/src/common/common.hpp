@@ -2,11 +2,13 @@
 #define __COMMON_H
 
 #include <iostream>
+#include <string>
 #include <bitset>
 #include <cstring>
 #include <cctype>
 #include <map>
 #include <cinttypes>
+#include <type_traits>
 
 //----------------------------
 #include <shmem.h>
@@ -51,19 +53,169 @@
 #define KCOUNT_BUCKET_SIZE          10000
 #endif
 
-#define MINIMIZERLEN                9
+#ifndef KCOUNT_THREADS
+#define KCOUNT_THREADS              1 /* parsing threads per PE */
+#endif
+
+#ifndef KCOUNT_ROUNDS
+#define KCOUNT_ROUNDS               1 /* passes over the input, each counting a slice of the k-mers */
+#endif
+
+#ifndef NODE_PES
+#define NODE_PES                    0 /* PEs per node for -n (consecutive ranks), 0: PEs sharing memory */
+#endif
+
+#ifndef RECV_RADIX_BITS
+#define RECV_RADIX_BITS             8 /* received k-mers kept in 2^bits buckets by key prefix, 0: one array */
+#endif
+
+#ifndef SPILL_DIR
+#define SPILL_DIR                   "/tmp" /* node-local scratch of the --mem-limit runs */
+#endif
+
+#ifndef INPUT_WINDOW_SIZE
+#define INPUT_WINDOW_SIZE           (1ULL << 25) /* bytes of input read at once */
+#endif
+
+#ifndef HIST_BUCKETS
+#define HIST_BUCKETS                10000 /* exact k-mer spectrum bins, larger counts share one */
+#endif
+
+#ifndef QUERY_ROUND_SIZE
+#define QUERY_ROUND_SIZE            (1ULL << 25) /* bytes of queries a PE answers at once */
+#endif
+
+#ifndef MINIMIZERLEN
+#define MINIMIZERLEN                9 /* m of the minimizers picking the owner PE with -M */
+#endif
+
 #define MINCONTIGLEN                10000
 // -------------------------------------
 
 #define MAX_KMER_SIZE 64
 #define KMER_T_MAX UINT64_MAX
 
-#define KMER_MASK (((~0UL)) >> (64 - (2*KMERLEN)))
 #define MINIMIZER_MASK (((~0UL)) >> (64 - (2*MINIMIZERLEN)))
 
 typedef uint64_t kmer_t;
 typedef uint64_t count_t;
 
+/* 
+ * Fixed width multi-word k-mer used when 2k > 128 bits. w[0] holds the most 
+ * significant bits, so comparing the words in order gives the same order as 
+ * comparing the 2k-bit integers. Only the operators needed by the rolling 
+ * k-mer update and the final sort/merge are provided.
+ */
+template<int W>
+struct kmer_words {
+    uint64_t w[W];
+
+    kmer_words() = default;
+    constexpr kmer_words(uint64_t v) : w{} { w[W - 1] = v; }
+
+    /* mask with the lowest nbits bits set */
+    static constexpr kmer_words low_mask(int nbits) {
+        kmer_words m(0);
+        for (int i = W - 1; i >= 0; i--) {
+            int bits = nbits - 64 * (W - 1 - i);
+            m.w[i] = (bits >= 64) ? ~0ULL : ((bits <= 0) ? 0ULL : (~0ULL >> (64 - bits)));
+        }
+        return m;
+    }
+
+    constexpr kmer_words& operator<<=(int n) {
+        const int q = n / 64, r = n % 64;
+        for (int i = 0; i < W; i++) {
+            uint64_t hi = (i + q < W) ? w[i + q] : 0;
+            uint64_t lo = (i + q + 1 < W) ? w[i + q + 1] : 0;
+            w[i] = (r == 0) ? hi : ((hi << r) | (lo >> (64 - r)));
+        }
+        return *this;
+    }
+
+    constexpr kmer_words& operator>>=(int n) {
+        const int q = n / 64, r = n % 64;
+        for (int i = W - 1; i >= 0; i--) {
+            uint64_t lo = (i - q >= 0) ? w[i - q] : 0;
+            uint64_t hi = (i - q - 1 >= 0) ? w[i - q - 1] : 0;
+            w[i] = (r == 0) ? lo : ((lo >> r) | (hi << (64 - r)));
+        }
+        return *this;
+    }
+
+    constexpr kmer_words& operator|=(const kmer_words &o) { for (int i = 0; i < W; i++) w[i] |= o.w[i]; return *this; }
+    constexpr kmer_words& operator&=(const kmer_words &o) { for (int i = 0; i < W; i++) w[i] &= o.w[i]; return *this; }
+    constexpr kmer_words& operator^=(const kmer_words &o) { for (int i = 0; i < W; i++) w[i] ^= o.w[i]; return *this; }
+
+    friend constexpr kmer_words operator<<(kmer_words a, int n) { return a <<= n; }
+    friend constexpr kmer_words operator>>(kmer_words a, int n) { return a >>= n; }
+    friend constexpr kmer_words operator|(kmer_words a, const kmer_words &b) { return a |= b; }
+    friend constexpr kmer_words operator&(kmer_words a, const kmer_words &b) { return a &= b; }
+    friend constexpr kmer_words operator^(kmer_words a, const kmer_words &b) { return a ^= b; }
+
+    friend constexpr bool operator==(const kmer_words &a, const kmer_words &b) {
+        for (int i = 0; i < W; i++) if (a.w[i] != b.w[i]) return false;
+        return true;
+    }
+    friend constexpr bool operator!=(const kmer_words &a, const kmer_words &b) { return !(a == b); }
+    friend constexpr bool operator<(const kmer_words &a, const kmer_words &b) {
+        for (int i = 0; i < W; i++) if (a.w[i] != b.w[i]) return a.w[i] < b.w[i];
+        return false;
+    }
+    friend constexpr bool operator>(const kmer_words &a, const kmer_words &b) { return b < a; }
+    friend constexpr bool operator<=(const kmer_words &a, const kmer_words &b) { return !(b < a); }
+    friend constexpr bool operator>=(const kmer_words &a, const kmer_words &b) { return !(a < b); }
+};
+
+/* 
+ * Smallest k-mer type holding 2k bits: uint64_t up to k = 32 (unchanged 
+ * 64-bit path), __uint128_t up to k = 64, and kmer_words beyond that.
+ */
+template<int K>
+struct kmer_traits {
+    static constexpr int WORDS = (2 * K + 63) / 64;
+
+    typedef typename std::conditional<(K <= 32), uint64_t,
+            typename std::conditional<(K <= 64), __uint128_t, kmer_words<WORDS>>::type>::type type;
+
+    static constexpr type mask() {
+        if constexpr (K <= 32) return (~0ULL) >> (64 - (2 * K));
+        else if constexpr (K <= 64) return (~static_cast<__uint128_t>(0)) >> (128 - (2 * K));
+        else return kmer_words<WORDS>::low_mask(2 * K);
+    }
+};
+
+/* how a PE counts the k-mers it receives (-r) */
+enum recv_backend {RECV_SORT, RECV_HASH};
+
+/* 
+ * Run time parameters of the k-mer counter. The compile time variables 
+ * above only provide the default values; arg_parser overrides them and 
+ * kmercounter picks the matching pre-instantiated specialization.
+ */
+typedef struct kcount_config_type {
+    int kmer_len = KMERLEN;
+    int pkt_size = BIGKSIZE;
+    uint64_t bucket_size = KCOUNT_BUCKET_SIZE;
+    bool canonical = false; // count min(k-mer, reverse complement)
+    bool hitter = HITTER; // L3 aggregation of the repeats inside a C3 buffer
+    bool minimizer = false; // owner PE by minimizer, k-mers sent as packed super-k-mers
+    bool codec = false; // sorted, delta and Rice coded packets (k <= 32)
+    int threads = KCOUNT_THREADS; // threads parsing and sorting the reads of a PE
+    bool node_agg = false; // combine the k-mers of a node before they cross the network
+    int rounds = KCOUNT_ROUNDS; // passes over the input, each counting 1 / rounds of the k-mers
+    recv_backend receiver = RECV_SORT; // keep every received copy and sort, or count on receipt
+    uint64_t mem_limit = 0; // bytes of received k-mers per PE before a sorted run is spilled, 0: no limit
+    std::string spill_dir = SPILL_DIR; // where the spilled runs go
+    uint64_t est_kmers = 0, est_distinct = 0; // -e: k-mers and distinct k-mers a PE is expected to receive, 0: unknown
+    std::string output_file; // binary k-mer table, not written if empty
+    std::string query_file; // k-mer queries answered after counting, "-": names read from stdin
+    uint64_t min_count = MIN_KMER_COUNT; // k-mers counted fewer times are dropped
+    uint64_t max_count = MAX_KMER_COUNT; // k-mers counted more times are dropped
+    bool solid = false; // min_count from the valley of the k-mer spectrum
+    std::string hist_file; // k-mer spectrum, not written if empty
+} kcount_config;
+
 typedef struct read_seq { 
     char read_data[READLEN]; 
     int read_data_size = 0;
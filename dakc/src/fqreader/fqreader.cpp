@@ -1,80 +1,308 @@
-#include <iostream> 
-#include <string> 
+#include <iostream>
+#include <string>
 #include <sstream>
-#include <vector> 
+#include <vector>
 #include <cstring>
 #include <cmath>
 #include <cassert>
+#include <algorithm>
 
 #include <mpi.h>
 
 #include "fqreader.hpp"
 #include "common.hpp"
 
-char* fqreader::read_file() {
-    uint64_t numreads = 0, total_reads = 0, counted_reads = 0;
-    size_t read_data_size = 0;
-    double starttime, endtime, local_readingtime, global_readingtime;
-    char *chunk; 
-    MPI_Offset filesize, start, end, readbuf;
+#define PROBE_SIZE      (1 << 16)     /* initial window used to find a record boundary */
+#define MAX_READ_COUNT  (1 << 30)     /* MPI counts are ints, read in 1GB pieces */
 
-    if (!is_txt) {
-      std::cout << "FA and FQ files are not natively supported !!" << std::endl;
+void fqreader::read_range(char* buf, MPI_Offset start, MPI_Offset len) {
+    MPI_Offset done = 0;
+    while (done < len) {
+      int count = static_cast<int>(std::min<MPI_Offset>(len - done, MAX_READ_COUNT));
+      MPI_File_read_at(inputfile, start + done, buf + done, count, MPI_CHAR, MPI_STATUS_IGNORE);
+      done += count;
     }
+}
 
-    if (rank == 0) 
+bool fqreader::is_record_start(const char* buf, size_t pos, size_t len, bool at_eof, bool &need_more) {
+/*
+ * buf[pos] is the first character of a line. A FASTA record starts at a
+ * '>' line. A FASTQ record starts at a '@' line whose next-to-next line
+ * starts with '+' (a quality line may start with '@' as well, but then
+ * the line two below it is a sequence line).
+ */
+    if (is_fa) return buf[pos] == '>';
+    if (!is_fq) return true;
+    if (buf[pos] != '@') return false;
+
+    const char* nl1 = static_cast<const char*>(memchr(buf + pos, '\n', len - pos));
+    const char* nl2 = nl1 ? static_cast<const char*>(memchr(nl1 + 1, '\n', buf + len - nl1 - 1)) : NULL;
+
+    if (nl2 == NULL || nl2 + 1 >= buf + len) {
+      need_more = !at_eof;
+      return false;
+    }
+    return nl2[1] == '+';
+}
+
+MPI_Offset fqreader::find_record_start(MPI_Offset from, MPI_Offset filesize) {
+/*
+ * Returns the offset of the first record that starts at or after 'from'
+ * (filesize if there is none), in the spirit of PakMan*'s DivideReads.
+ * The probe window starts one byte early so that a record starting
+ * exactly at 'from' is recognized, and doubles whenever a FASTQ record
+ * needs more lines to be validated.
+ */
+    if (from <= 0) return 0;
+    if (from >= filesize) return filesize;
+
+    MPI_Offset probe_start = from - 1;
+    MPI_Offset probe = PROBE_SIZE;
+    std::vector<char> buf;
+
+    while (true) {
+      MPI_Offset len = std::min(probe, filesize - probe_start);
+      bool at_eof = (probe_start + len == filesize);
+      bool need_more = false;
+
+      buf.resize(len);
+      read_range(buf.data(), probe_start, len);
+
+      for (size_t j = 1; j < static_cast<size_t>(len); j++) {
+        if (buf[j - 1] != '\n') continue;
+        if (is_record_start(buf.data(), j, len, at_eof, need_more)) return probe_start + j;
+        if (need_more) break;
+      }
+
+      if (at_eof && !need_more) return filesize;
+      probe *= 2;
+    }
+}
+
+
+void fqreader::open_stream(uint64_t window_size, int kmer_len) {
+    MPI_Offset filesize;
+
+    if (!is_txt && !is_fq && !is_fa) {
+      if (rank == 0)
+        std::cout << "Unknown extension, reading the input as header-stripped .txt" << std::endl;
+      is_txt = true;
+    }
+
+    if (rank == 0)
       std::cout << "Start reading the input dataset(s)" << std::endl;
 
-    int ierr = MPI_File_open(MPI_COMM_WORLD, filename.c_str(), 
+    int ierr = MPI_File_open(MPI_COMM_WORLD, filename.c_str(),
       MPI_MODE_RDONLY, MPI_INFO_NULL, &inputfile);
-    
+
     if (ierr) {
-      if (rank == 0) 
+      if (rank == 0)
           std::cout << "Could not open the input (modified) FASTA/Q file" << std::endl;
       MPI_Finalize();
       exit(2);
     }
 
-    // Start the timer
-    starttime = MPI_Wtime();
-
     MPI_File_get_size(inputfile, &filesize);
-    
-    total_reads = (filesize + 1) / (read_len + 1); // each character is 1 BYTE
-    localsize = total_reads / size;
-    localsize *= (read_len + 1);
 
-    start = rank * localsize;
-    end = start + localsize - 1;
+    this->window_size = std::max<uint64_t>(1, std::min<uint64_t>(window_size, MAX_READ_COUNT));
+    this->kmer_len = kmer_len;
+    nwindows = 0;
+    next_parse = 0;
 
-    if (rank == size - 1) end = (filesize - 1);
+    if (is_gz) {
+      open_gz_stream(filesize);
+      return;
+    }
+
+    /*
+     * Split the file into equal byte ranges and move every boundary to the
+     * next record start, so that each PE owns whole records only. The end
+     * of a PE's range is the (aligned) start of the next PE.
+     */
+    start = find_record_start(rank * (filesize / size), filesize);
+
+    std::vector<MPI_Offset> starts(size);
+    MPI_Allgather(&start, 1, MPI_OFFSET, starts.data(), 1, MPI_OFFSET, MPI_COMM_WORLD);
+    end = (rank == size - 1) ? filesize : starts[rank + 1];
 
-    localsize = end - start + 1;
+    localsize = end - start;
 
-  #if DEBUG 
+  #if DEBUG
     std::cout << "PE: " << start << ", " << end << std::endl;
   #endif
 
-    // Provide enough space for the string storing the local data
-    chunk = (char*) malloc( (localsize + 1) * sizeof(char) );
-    chunk[localsize] = '\0';
+    nwindows = (localsize + this->window_size - 1) / this->window_size;
+
+    ring.resize(INPUT_WINDOWS);
+    ring_req.assign(INPUT_WINDOWS, MPI_REQUEST_NULL);
+    for (int i = 0; i < INPUT_WINDOWS; i++) {
+      ring[i].resize(std::min<uint64_t>(this->window_size, localsize));
+      post_window(i);
+    }
+    out.reserve(std::min<uint64_t>(this->window_size, localsize) + kmer_len + 1);
+}
+
+void fqreader::post_window(uint64_t window) {
+    if (window >= nwindows) return;
+
+    MPI_Offset offset = start + window * window_size;
+    int count = static_cast<int>(std::min<MPI_Offset>(window_size, end - offset));
+
+    MPI_File_iread_at(inputfile, offset, ring[window % INPUT_WINDOWS].data(), count,
+                      MPI_CHAR, &ring_req[window % INPUT_WINDOWS]);
+}
+
+void fqreader::progress() {
+/*
+ * Lets the MPI library advance the outstanding reads while the caller is
+ * busy counting.
+ */
+    int flag;
+    for (size_t i = 0; i < ring_req.size(); i++) {
+      if (ring_req[i] != MPI_REQUEST_NULL) MPI_Test(&ring_req[i], &flag, MPI_STATUS_IGNORE);
+    }
+}
+
+bool fqreader::next_window(char* &data, uint64_t &len) {
+    if (peeked) {
+      peeked = false;
+      data = out.data();
+      len = out.size();
+      return peeked_more;
+    }
+
+    if (is_gz) {
+      double starttime = MPI_Wtime();
+      bool more = next_gz_chunk();
+      wait_time += MPI_Wtime() - starttime;
+      if (!more) return false;
+
+      parse_window(gz_chunk.data(), gz_chunk.size(), false);
+      window_bytes = gz_chunk.size();
+      data = out.data();
+      len = out.size();
+      return true;
+    }
+
+    if (next_parse >= nwindows) return false;
+
+    int slot = next_parse % INPUT_WINDOWS;
+    MPI_Offset offset = start + next_parse * window_size;
+    size_t count = std::min<MPI_Offset>(window_size, end - offset);
+
+    double starttime = MPI_Wtime();
+    MPI_Wait(&ring_req[slot], MPI_STATUS_IGNORE);
+    wait_time += MPI_Wtime() - starttime;
+
+    parse_window(ring[slot].data(), count, next_parse == nwindows - 1);
+    window_bytes = count;
+
+    // the raw bytes are consumed, reuse the buffer for a later window
+    post_window(next_parse + INPUT_WINDOWS);
+    next_parse++;
+
+    data = out.data();
+    len = out.size();
+    return true;
+}
+
+bool fqreader::peek_window(char* &data, uint64_t &len) {
+    if (!peeked) {
+      peeked_more = next_window(data, len);
+      peeked = true;
+    }
+    data = out.data();
+    len = out.size();
+    return peeked_more;
+}
+
+void fqreader::append_sequence(const char* seq, size_t len) {
+    if (len > 0 && seq[len - 1] == '\r') len--;
+    if (len == 0) return;
+
+    if (!line_open) {
+      line_start = out.size();
+      line_open = true;
+    }
+    out.insert(out.end(), seq, seq + len);
+}
+
+void fqreader::close_line() {
+    if (!line_open) return;
+    out.push_back('\n');
+    line_open = false;
+}
 
-    // Set the file view for each process
-    MPI_File_set_view(inputfile, start, MPI_CHAR, MPI_CHAR, "native", 
-                     MPI_INFO_NULL);
+void fqreader::parse_window(const char* data, size_t len, bool last) {
+/*
+ * Copies the sequence lines of a window into 'out'. FASTQ records are 4
+ * lines (header, sequence, '+', quality), the lines of a FASTA record are
+ * joined into one sequence, and every line of a .txt file is a read.
+ */
+    size_t pos = 0;
 
-    // Read the chunk of the file
-    MPI_File_read(inputfile, chunk, localsize, MPI_CHAR, MPI_STATUS_IGNORE);
-    // MPI_Barrier(MPI_COMM_WORLD); // should I used MPI_File_read_all in this step? 
-    endtime = MPI_Wtime();
+    out.clear();
 
-    // free the variables 
+    // reopen the sequence cut at the end of the previous window
+    if (!seq_tail.empty()) {
+      append_sequence(seq_tail.data(), seq_tail.size());
+      seq_tail.clear();
+    }
+
+    while (pos < len) {
+      if (at_line_start) {
+        at_line_start = false;
+        if (is_fa) {
+          in_seq_line = (data[pos] != '>');
+          if (!in_seq_line) {
+            close_line();
+            numreads++;
+          }
+        } else if (is_fq) {
+          in_seq_line = (fq_line == 1);
+          if (fq_line == 0) numreads++;
+        } else {
+          in_seq_line = true;
+          numreads++;
+        }
+      }
+
+      const char* nl = static_cast<const char*>(memchr(data + pos, '\n', len - pos));
+      size_t seg_end = nl ? (nl - data) : len;
+
+      if (in_seq_line) append_sequence(data + pos, seg_end - pos);
+
+      if (nl) {
+        // FASTA sequences continue on the next line
+        if (!is_fa) close_line();
+        if (is_fq) fq_line = (fq_line + 1) & 3;
+        at_line_start = true;
+      }
+      pos = seg_end + 1;
+    }
+
+    // keep k - 1 bases so that no k-mer across the boundary is lost
+    if (line_open && !last) {
+      size_t tail = std::min<size_t>(kmer_len - 1, out.size() - line_start);
+      seq_tail.assign(out.end() - tail, out.end());
+    }
+    close_line();
+}
+
+void fqreader::close_stream() {
+    uint64_t counted_reads = 0;
+    double global_waittime;
+
+    for (size_t i = 0; i < ring_req.size(); i++) {
+      if (ring_req[i] != MPI_REQUEST_NULL) MPI_Wait(&ring_req[i], MPI_STATUS_IGNORE);
+    }
+    if (is_gz) gz.stop();
     MPI_File_close(&inputfile);
 
-    // calculate the time taken in reading the inputs
-    local_readingtime = endtime - starttime;
-    MPI_Barrier(MPI_COMM_WORLD); // Is this even required ?
-    MPI_Reduce(&local_readingtime, &global_readingtime, 1, MPI_DOUBLE, 
+    std::vector<std::vector<char>>().swap(ring);
+    std::vector<char>().swap(out);
+
+    MPI_Reduce(&wait_time, &global_waittime, 1, MPI_DOUBLE,
                MPI_MAX, 0, MPI_COMM_WORLD);
 
     MPI_Reduce(&numreads, &counted_reads, 1, MPI_UINT64_T, MPI_SUM,
@@ -82,9 +310,190 @@ char* fqreader::read_file() {
 
     // Print the performance metric
     if (rank == 0) {
-        std::cout << "Reading time: " << global_readingtime
+        std::cout << "Reading time (not hidden behind counting): " << global_waittime
         << " seconds using " << size << " processors." << std::endl;
+        std::cout << "Total number of reads: " << counted_reads << std::endl;
+    }
+}
+
+void fqreader::rewind() {
+/*
+ * Starts the stream over from the first window (counting rounds): the
+ * reads in flight are dropped, the parser state is reset and the input
+ * opened again. Only the last pass counts the reads.
+ */
+    for (size_t i = 0; i < ring_req.size(); i++) {
+      if (ring_req[i] != MPI_REQUEST_NULL) MPI_Wait(&ring_req[i], MPI_STATUS_IGNORE);
+    }
+    if (is_gz) gz.stop();
+    MPI_File_close(&inputfile);
+
+    at_line_start = true;
+    in_seq_line = false;
+    line_open = false;
+    fq_line = 0;
+    line_start = 0;
+    seq_tail.clear();
+    peeked = peeked_more = false;
+    gz_pending.clear();
+    gz_suffix.clear();
+    gz_chunk.clear();
+    numreads = 0;
+
+    open_stream(window_size, kmer_len);
+}
+
+size_t fqreader::first_record_start(const char* buf, size_t len, bool at_eof, bool &need_more) {
+/*
+ * Offset of the first record that starts after buf[0] (len if there is
+ * none, or if buf ends before the next record can be validated).
+ */
+    need_more = false;
+    for (size_t j = 1; j < len; j++) {
+      if (buf[j - 1] != '\n') continue;
+      if (is_record_start(buf, j, len, at_eof, need_more)) return j;
+      if (need_more) break;
+    }
+    return len;
+}
+
+size_t fqreader::last_record_start(const char* buf, size_t len, bool at_eof) {
+/*
+ * Offset of the last record of buf that can be validated (0 if none).
+ */
+    bool need_more;
+    for (size_t j = len; j > 1; j--) {
+      if (buf[j - 2] != '\n') continue;
+      need_more = false;
+      if (is_record_start(buf, j - 1, len, at_eof, need_more) && !need_more) return j - 1;
+    }
+    return 0;
+}
+
+void fqreader::open_gz_stream(MPI_Offset filesize) {
+/*
+ * BGZF: every PE inflates the blocks starting in its byte range, which do
+ * not end on a record boundary. The bytes before a PE's first record are
+ * the end of the previous PE's last record, so they are sent to the
+ * previous PE, which counts them after its own data. A PE whose data holds
+ * no record start at all forwards everything, after receiving from the
+ * next PE, so the exchange completes from the last PE downwards.
+ */
+    std::vector<char> head, chunk;
+    size_t skip = 0;
+    bool has_start = true;
+
+    gz.open(filename, inputfile, filesize, rank, size, window_size, INPUT_WINDOWS);
+    if (rank == 0)
+      std::cout << "Compressed input, " << (gz.is_bgzf ? "BGZF blocks are inflated by every PE"
+                : "plain gzip is inflated by PE 0 and scattered") << std::endl;
+
+    if (!gz.is_bgzf) {
+      scatter_plain_gz();
+      return;
+    }
+
+    if (rank > 0) {
+      bool at_eof = false, need_more;
+      while (true) {
+        skip = first_record_start(head.data(), head.size(), at_eof, need_more);
+        if (skip < head.size() || at_eof) break;
+
+        if (gz.next_chunk(chunk)) head.insert(head.end(), chunk.begin(), chunk.end());
+        else at_eof = true;
+      }
+      has_start = (skip < head.size());
+    }
+
+    MPI_Request req = MPI_REQUEST_NULL;
+    if (rank > 0 && has_start)
+      MPI_Isend(head.data(), skip, MPI_CHAR, rank - 1, 0, MPI_COMM_WORLD, &req);
+
+    if (rank < size - 1) {
+      MPI_Status status;
+      int count;
+      MPI_Probe(rank + 1, 0, MPI_COMM_WORLD, &status);
+      MPI_Get_count(&status, MPI_CHAR, &count);
+      gz_suffix.resize(count);
+      MPI_Recv(gz_suffix.data(), count, MPI_CHAR, rank + 1, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
+
+    if (rank > 0 && !has_start) {
+      head.insert(head.end(), gz_suffix.begin(), gz_suffix.end());
+      MPI_Send(head.data(), head.size(), MPI_CHAR, rank - 1, 0, MPI_COMM_WORLD);
+      gz_suffix.clear();
+      head.clear();
     }
+    MPI_Wait(&req, MPI_STATUS_IGNORE);
 
-    return chunk;
-}
\ No newline at end of file
+    head.erase(head.begin(), head.begin() + std::min(skip, head.size()));
+    if (!head.empty()) gz_pending.push_back(std::move(head)); // PE 0's is, its first window would be empty
+}
+
+void fqreader::scatter_plain_gz() {
+/*
+ * Plain gzip: PE 0 inflates the stream and, in rounds of about one window
+ * per PE, cuts the records it has into one piece per PE. A record cut by
+ * the end of a round is kept for the next one. Every PE holds its pieces
+ * until they are counted.
+ */
+    std::vector<char> buf, chunk;
+    std::vector<int> counts(size), displs(size);
+    const size_t round_size = std::min<uint64_t>(size * window_size, MAX_READ_COUNT);
+    bool at_eof = false, need_more;
+
+    while (true) {
+      int more = 0, mycount = 0;
+      size_t round_end = 0;
+
+      if (rank == 0) {
+        while (!at_eof) {
+          if (buf.size() >= round_size) {
+            round_end = last_record_start(buf.data(), buf.size(), false);
+            if (round_end > 0) break;
+          }
+          if (gz.next_chunk(chunk)) buf.insert(buf.end(), chunk.begin(), chunk.end());
+          else at_eof = true;
+        }
+        if (at_eof) round_end = buf.size();
+        more = (round_end > 0);
+
+        size_t prev = 0;
+        for (int i = 0; i < size; i++) {
+          size_t cut = round_end;
+          size_t from = std::max(prev, round_end / size * (i + 1));
+          if (i < size - 1 && from > 0 && from < round_end)
+            cut = from - 1 + first_record_start(buf.data() + from - 1, round_end - from + 1, true, need_more);
+          counts[i] = cut - prev;
+          displs[i] = prev;
+          prev = cut;
+        }
+      }
+
+      MPI_Bcast(&more, 1, MPI_INT, 0, MPI_COMM_WORLD);
+      if (!more) break;
+
+      MPI_Scatter(counts.data(), 1, MPI_INT, &mycount, 1, MPI_INT, 0, MPI_COMM_WORLD);
+      std::vector<char> piece(mycount);
+      MPI_Scatterv(buf.data(), counts.data(), displs.data(), MPI_CHAR,
+                   piece.data(), mycount, MPI_CHAR, 0, MPI_COMM_WORLD);
+      if (mycount > 0) gz_pending.push_back(std::move(piece));
+
+      if (rank == 0) buf.erase(buf.begin(), buf.begin() + round_end);
+    }
+}
+
+bool fqreader::next_gz_chunk() {
+    if (!gz_pending.empty()) {
+      gz_chunk = std::move(gz_pending.front());
+      gz_pending.pop_front();
+      return true;
+    }
+    if (gz.next_chunk(gz_chunk)) return true;
+    if (!gz_suffix.empty()) {
+      gz_chunk = std::move(gz_suffix);
+      gz_suffix.clear();
+      return true;
+    }
+    return false;
+}
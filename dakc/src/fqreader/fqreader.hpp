@@ -1,53 +1,127 @@
 #ifndef FQREADER_H
 #define FQREADER_H
 
-#include <iostream> 
-#include <string> 
+#include <iostream>
+#include <string>
 #include <vector>
 #include <sstream>
+#include <deque>
 
 #include <mpi.h>
 
 #include "common.hpp"
+#include "gzreader.hpp"
 
-class fqreader { 
-public: 
+/* number of input windows in flight, 2 is plain double buffering */
+#ifndef INPUT_WINDOWS
+#define INPUT_WINDOWS 2
+#endif
+
+class fqreader {
+public:
     MPI_File inputfile;
     bool is_fq = true;
-    bool is_txt = true; 
-    int rank, size, read_len; 
+    bool is_fa = true;
+    bool is_txt = true;
+    bool is_gz = false;
+    int rank, size;
     std::string filename;
     MPI_Offset localsize;
+    uint64_t window_bytes = 0; // input bytes (inflated for .gz) of the last window parsed
 
-    fqreader(std::string filename, const int read_length, const int rank, 
-            const int size) { 
-        this->rank = rank; 
-        this->size = size; 
-        this->read_len = read_length;
+    fqreader(std::string filename, const int rank, const int size) {
+        this->rank = rank;
+        this->size = size;
         this->filename = filename;
 
         // break the filename based on delimeter '.'
         std::istringstream iss(this->filename);
-        std::string token;
+        std::string token, prev_token;
 
-        while (std::getline(iss, token, '.')) { 
+        while (std::getline(iss, token, '.')) {
             // std::cout << token << std::endl;
-            // do nothing
-        } 
+            if (token == "gz" || token == "bgz") this->is_gz = true;
+            else prev_token = token;
+        }
+
+        // reads.fq.gz is a compressed .fq file
+        if (this->is_gz) token = prev_token;
 
         // update the is_fq flag depending upon the token
-        if (token != "fq") this->is_fq = false;
+        if (token != "fq" && token != "fastq") this->is_fq = false;
+        if (token != "fa" && token != "fasta" && token != "fna") this->is_fa = false;
         if (token != "txt") this->is_txt = false;
 
-        // opportunity to serially peek into the file and 
+        // opportunity to serially peek into the file and
         // get the readbuf information dynamically
     }
 
-    char* read_file();
+    /*
+     * Streaming interface: open_stream() aligns this PE's byte range to
+     * record boundaries and posts the first INPUT_WINDOWS reads of
+     * window_size bytes. Every next_window() call waits for the oldest
+     * one, re-posts its buffer for the next window and returns the
+     * sequences found in it as newline separated lines. A sequence cut
+     * by a window boundary continues on the next window's first line
+     * with its last kmer_len - 1 bases repeated. The returned buffer stays
+     * valid until the next call. peek_window() returns the same window as
+     * the next next_window() call without consuming it. Collective:
+     * open_stream, close_stream, rewind.
+     *
+     * Compressed (.gz) input is inflated by a gzreader instead; its chunks
+     * are aligned to records by handing the bytes before the first record
+     * of every PE to the previous PE (see open_gz_stream).
+     */
+    void open_stream(uint64_t window_size, int kmer_len);
+    bool next_window(char* &data, uint64_t &len);
+    bool peek_window(char* &data, uint64_t &len);
+    void progress();
+    void close_stream();
+    void rewind();
 
-private: 
+private:
     bool saw_at = false;
     bool saw_plus = false;
+
+    // input range of this PE, split into windows
+    MPI_Offset start, end;
+    uint64_t window_size, nwindows, next_parse;
+    std::vector<std::vector<char>> ring;
+    std::vector<MPI_Request> ring_req;
+    double wait_time = 0;
+    bool peeked = false, peeked_more = false; // next window already parsed by peek_window
+
+    // compressed input
+    gzreader gz;
+    std::deque<std::vector<char>> gz_pending; // served before the decoder's chunks
+    std::vector<char> gz_suffix;              // start of the next PE's data, served last
+    std::vector<char> gz_chunk;
+
+    // parser state carried from one window to the next
+    int kmer_len;
+    bool at_line_start = true;
+    bool in_seq_line = false;
+    bool line_open = false;
+    int fq_line = 0; // 0: header, 1: sequence, 2: '+', 3: quality
+    size_t line_start = 0;
+    std::string seq_tail;
+    std::vector<char> out;
+    uint64_t numreads = 0;
+
+    MPI_Offset find_record_start(MPI_Offset from, MPI_Offset filesize);
+    bool is_record_start(const char* buf, size_t pos, size_t len, bool at_eof, bool &need_more);
+    void read_range(char* buf, MPI_Offset start, MPI_Offset len);
+
+    void post_window(uint64_t window);
+    void open_gz_stream(MPI_Offset filesize);
+    void scatter_plain_gz();
+    size_t first_record_start(const char* buf, size_t len, bool at_eof, bool &need_more);
+    size_t last_record_start(const char* buf, size_t len, bool at_eof);
+    bool next_gz_chunk();
+
+    void parse_window(const char* data, size_t len, bool last);
+    void append_sequence(const char* seq, size_t len);
+    void close_line();
 };
 
-#endif
\ No newline at end of file
+#endif
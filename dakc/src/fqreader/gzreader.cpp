@@ -0,0 +1,281 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <mpi.h>
+
+#include "gzreader.hpp"
+
+#define BGZF_MAX_BLOCK  (1 << 16)     /* a BGZF block is at most 64KB, compressed or not */
+#define GZ_INPUT_SIZE   (1 << 22)     /* compressed bytes read by the decoder at once */
+
+long gzreader::bgzf_block_size(const unsigned char* buf, size_t len) {
+/*
+ * Returns the total size of the BGZF block whose header starts at buf,
+ * or -1 if buf does not start with a BGZF header.
+ */
+    if (len < 18) return -1;
+    if (buf[0] != 0x1f || buf[1] != 0x8b || buf[2] != 8 || !(buf[3] & 0x4)) return -1;
+
+    size_t xlen = buf[10] | (buf[11] << 8);
+    size_t pos = 12;
+    if (len < 12 + xlen) return -1;
+
+    while (pos + 4 <= 12 + xlen) {
+      size_t slen = buf[pos + 2] | (buf[pos + 3] << 8);
+      if (buf[pos] == 'B' && buf[pos + 1] == 'C' && slen == 2 && pos + 6 <= 12 + xlen)
+        return (buf[pos + 4] | (buf[pos + 5] << 8)) + 1;
+      pos += 4 + slen;
+    }
+    return -1;
+}
+
+MPI_Offset gzreader::find_block_start(MPI_File &file, MPI_Offset from, MPI_Offset filesize) {
+/*
+ * First BGZF block starting at or after 'from'. Blocks are at most 64KB
+ * apart, so a probe of two blocks always holds a block and the header of
+ * the one after it; a candidate only counts if that next header is valid
+ * as well (or the candidate is the last block of the file).
+ */
+    if (from <= 0) return 0;
+    if (from >= filesize) return filesize;
+
+    MPI_Offset len = std::min<MPI_Offset>(2 * BGZF_MAX_BLOCK + 64, filesize - from);
+    std::vector<unsigned char> buf(len);
+    MPI_File_read_at(file, from, buf.data(), len, MPI_BYTE, MPI_STATUS_IGNORE);
+
+    for (MPI_Offset pos = 0; pos < len; pos++) {
+      long bs = bgzf_block_size(buf.data() + pos, len - pos);
+      if (bs < 0) continue;
+
+      MPI_Offset next = from + pos + bs;
+      if (next == filesize) return from + pos;
+      if (next > filesize) continue;
+
+      unsigned char next_hdr[64];
+      MPI_Offset next_len = std::min<MPI_Offset>(sizeof(next_hdr), filesize - next);
+      if (pos + bs + next_len <= len) {
+        memcpy(next_hdr, buf.data() + pos + bs, next_len);
+      } else {
+        MPI_File_read_at(file, next, next_hdr, next_len, MPI_BYTE, MPI_STATUS_IGNORE);
+      }
+      if (bgzf_block_size(next_hdr, next_len) > 0) return from + pos;
+    }
+    return filesize;
+}
+
+void gzreader::open(const std::string &filename, MPI_File &file, MPI_Offset filesize,
+                    int rank, int size, uint64_t chunk_size, int max_chunks) {
+    unsigned char hdr[64];
+    MPI_Offset hdr_len = std::min<MPI_Offset>(sizeof(hdr), filesize);
+
+    this->filename = filename;
+    this->chunk_size = chunk_size;
+    this->max_chunks = max_chunks;
+
+    // a stopped reader opens again (fqreader::rewind)
+    ready.clear();
+    finished = failed = stopping = false;
+    error.clear();
+
+    MPI_File_read_at(file, 0, hdr, hdr_len, MPI_BYTE, MPI_STATUS_IGNORE);
+    is_bgzf = (bgzf_block_size(hdr, hdr_len) > 0);
+
+    if (is_bgzf) {
+      cstart = find_block_start(file, rank * (filesize / size), filesize);
+
+      std::vector<MPI_Offset> starts(size);
+      MPI_Allgather(&cstart, 1, MPI_OFFSET, starts.data(), 1, MPI_OFFSET, MPI_COMM_WORLD);
+      cend = (rank == size - 1) ? filesize : starts[rank + 1];
+
+      decoder = std::thread(&gzreader::decode_bgzf, this);
+    } else if (rank == 0) {
+      cstart = 0;
+      cend = filesize;
+      decoder = std::thread(&gzreader::decode_plain, this);
+    } else {
+      finished = true;
+    }
+}
+
+bool gzreader::next_chunk(std::vector<char> &chunk) {
+    std::unique_lock<std::mutex> guard(lock);
+    cv_ready.wait(guard, [this] { return !ready.empty() || finished; });
+
+    if (failed) {
+      std::cout << "Could not decompress the input: " << error << std::endl;
+      MPI_Abort(MPI_COMM_WORLD, 2);
+    }
+    if (ready.empty()) return false;
+
+    chunk = std::move(ready.front());
+    ready.pop_front();
+    cv_space.notify_one();
+    return true;
+}
+
+void gzreader::stop() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    cv_space.notify_all();
+    if (decoder.joinable()) decoder.join();
+}
+
+bool gzreader::push_chunk(std::vector<char> &chunk) {
+    std::unique_lock<std::mutex> guard(lock);
+    cv_space.wait(guard, [this] { return static_cast<int>(ready.size()) < max_chunks || stopping; });
+    if (stopping) return false;
+
+    ready.push_back(std::move(chunk));
+    chunk.clear();
+    cv_ready.notify_one();
+    return true;
+}
+
+void gzreader::finish(const std::string &err) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      finished = true;
+      failed = !err.empty();
+      error = err;
+    }
+    cv_ready.notify_all();
+}
+
+void gzreader::decode_bgzf() {
+/*
+ * Inflates the blocks in [cstart, cend). Every block is an independent
+ * raw deflate stream whose decompressed size (ISIZE) is stored in the
+ * last 4 bytes of the block, so it is inflated in place into the chunk.
+ */
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return finish("cannot open " + filename);
+
+    std::vector<unsigned char> in(GZ_INPUT_SIZE + BGZF_MAX_BLOCK);
+    std::vector<char> chunk;
+    size_t have = 0, used = 0;
+    MPI_Offset offset = cstart;
+    std::string err;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    inflateInit2(&zs, -15);
+    chunk.reserve(chunk_size + BGZF_MAX_BLOCK);
+
+    while (true) {
+      // keep at least one whole block in the input buffer
+      if (have - used < BGZF_MAX_BLOCK && offset < cend) {
+        memmove(in.data(), in.data() + used, have - used);
+        have -= used;
+        used = 0;
+
+        size_t count = std::min<MPI_Offset>(in.size() - have, cend - offset);
+        ssize_t n = pread(fd, in.data() + have, count, offset);
+        if (n <= 0) { err = "read error"; break; }
+        have += n;
+        offset += n;
+      }
+      if (used == have) break;
+
+      long bs = bgzf_block_size(in.data() + used, have - used);
+      if (bs < 0 || used + bs > have) { err = "corrupt BGZF block"; break; }
+
+      const unsigned char* block = in.data() + used;
+      size_t hdr_len = 12 + (block[10] | (block[11] << 8));
+      uint32_t isize, crc;
+      memcpy(&crc, block + bs - 8, sizeof(crc));
+      memcpy(&isize, block + bs - 4, sizeof(isize));
+
+      size_t old_size = chunk.size();
+      chunk.resize(old_size + isize);
+
+      inflateReset(&zs);
+      zs.next_in = const_cast<unsigned char*>(block + hdr_len);
+      zs.avail_in = bs - hdr_len - 8;
+      zs.next_out = reinterpret_cast<unsigned char*>(chunk.data() + old_size);
+      zs.avail_out = isize;
+
+      if (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.avail_out != 0 ||
+          crc32(0, reinterpret_cast<unsigned char*>(chunk.data() + old_size), isize) != crc) {
+        err = "corrupt BGZF block";
+        break;
+      }
+      used += bs;
+
+      if (chunk.size() >= chunk_size) {
+        if (!push_chunk(chunk)) break;
+        chunk.reserve(chunk_size + BGZF_MAX_BLOCK);
+      }
+    }
+
+    if (err.empty() && !chunk.empty()) push_chunk(chunk);
+
+    inflateEnd(&zs);
+    ::close(fd);
+    finish(err);
+}
+
+void gzreader::decode_plain() {
+/*
+ * Inflates a whole (possibly multi-member) gzip file, run on PE 0 only.
+ */
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return finish("cannot open " + filename);
+
+    std::vector<unsigned char> in(GZ_INPUT_SIZE);
+    std::vector<char> chunk(chunk_size);
+    size_t filled = 0;
+    MPI_Offset offset = cstart;
+    bool in_member = false;
+    std::string err;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    inflateInit2(&zs, 15 + 16);
+
+    while (true) {
+      if (zs.avail_in == 0) {
+        size_t count = std::min<MPI_Offset>(in.size(), cend - offset);
+        if (count == 0) break;
+        ssize_t n = pread(fd, in.data(), count, offset);
+        if (n <= 0) { err = "read error"; break; }
+        offset += n;
+        zs.next_in = in.data();
+        zs.avail_in = n;
+      }
+
+      zs.next_out = reinterpret_cast<unsigned char*>(chunk.data() + filled);
+      zs.avail_out = chunk_size - filled;
+
+      int ret = inflate(&zs, Z_NO_FLUSH);
+      if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) { err = "corrupt gzip stream"; break; }
+      filled = chunk_size - zs.avail_out;
+      in_member = (ret != Z_STREAM_END);
+
+      // concatenated gzip members
+      if (ret == Z_STREAM_END) inflateReset(&zs);
+
+      if (filled == chunk_size) {
+        if (!push_chunk(chunk)) break;
+        chunk.resize(chunk_size);
+        filled = 0;
+      }
+    }
+
+    if (err.empty() && in_member) err = "truncated gzip stream";
+    if (err.empty() && filled > 0) {
+      chunk.resize(filled);
+      push_chunk(chunk);
+    }
+
+    inflateEnd(&zs);
+    ::close(fd);
+    finish(err);
+}
@@ -0,0 +1,66 @@
+#ifndef GZREADER_H
+#define GZREADER_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <mpi.h>
+
+/*
+ * Inflates this PE's part of a gzip compressed input on a decoder thread.
+ *
+ * BGZF files (bgzip output: a series of gzip members of at most 64KB, each
+ * carrying its compressed size in a 'BC' extra field) are split on block
+ * boundaries: every PE inflates the blocks that start in its byte range.
+ * A plain gzip stream cannot be split, so only PE 0 inflates it and
+ * fqreader scatters the records to the other PEs.
+ *
+ * The decoder thread only uses POSIX I/O and zlib, MPI stays on the main
+ * thread. Decompressed data is handed over in chunks of about chunk_size
+ * bytes, at most max_chunks of them are queued at a time.
+ */
+class gzreader {
+public:
+    bool is_bgzf = false;
+
+    ~gzreader() { stop(); }
+
+    // collective: detects the format and locates this PE's BGZF blocks
+    void open(const std::string &filename, MPI_File &file, MPI_Offset filesize,
+              int rank, int size, uint64_t chunk_size, int max_chunks);
+
+    // false once the decoder has delivered everything
+    bool next_chunk(std::vector<char> &chunk);
+
+    void stop();
+
+private:
+    std::string filename;
+    MPI_Offset cstart = 0, cend = 0; // compressed range inflated by this PE
+    uint64_t chunk_size;
+    int max_chunks;
+
+    std::thread decoder;
+    std::mutex lock;
+    std::condition_variable cv_ready, cv_space;
+    std::deque<std::vector<char>> ready;
+    bool finished = false;
+    bool failed = false;
+    bool stopping = false;
+    std::string error;
+
+    static long bgzf_block_size(const unsigned char* buf, size_t len);
+    MPI_Offset find_block_start(MPI_File &file, MPI_Offset from, MPI_Offset filesize);
+
+    bool push_chunk(std::vector<char> &chunk);
+    void finish(const std::string &err);
+    void decode_bgzf();
+    void decode_plain();
+};
+
+#endif
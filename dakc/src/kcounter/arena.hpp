@@ -0,0 +1,97 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <type_traits>
+#include <sys/mman.h>
+
+#ifndef ARENA_MMAP_MIN
+#define ARENA_MMAP_MIN (1ULL << 20) /* smaller arrays come from the heap */
+#endif
+
+#ifndef ARENA_HUGE_MIN
+#define ARENA_HUGE_MIN (1ULL << 26) /* arenas from this size on are backed by huge pages */
+#endif
+
+#ifndef ARENA_MAX_BYTES
+#define ARENA_MAX_BYTES (1ULL << 40) /* most address space an array reserves up front */
+#endif
+
+#ifndef ARENA_GZ_RATIO
+#define ARENA_GZ_RATIO 4 /* assumed inflation of .gz input when presizing */
+#endif
+
+#define ARENA_PAGE (1ULL << 21) /* huge page size the mappings are rounded to */
+
+/*
+ * Allocator of the receive arrays. An array of at least ARENA_MMAP_MIN
+ * bytes gets its own anonymous mapping with MAP_NORESERVE, so reserving
+ * the expected final size up front only takes address space: a page is
+ * backed once it is written, and growing within the reservation never
+ * copies. From ARENA_HUGE_MIN bytes on the mapping asks for transparent
+ * huge pages, fewer TLB misses for the sorts and scans over it. Elements
+ * are default-initialized, so resize() does not touch the pages either.
+ */
+template<typename T>
+struct arena_allocator {
+  typedef T value_type;
+
+  arena_allocator() = default;
+  template<typename U> arena_allocator(const arena_allocator<U> &) {}
+
+  T* allocate(size_t n) {
+    const size_t bytes = n * sizeof(T);
+    if (bytes < ARENA_MMAP_MIN) return static_cast<T*>(::operator new(bytes));
+
+    void* p = mmap(NULL, mapped(bytes), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) throw std::bad_alloc();
+    #ifdef MADV_HUGEPAGE
+    if (bytes >= ARENA_HUGE_MIN) madvise(p, mapped(bytes), MADV_HUGEPAGE);
+    #endif
+    return static_cast<T*>(p);
+  }
+
+  void deallocate(T* p, size_t n) {
+    const size_t bytes = n * sizeof(T);
+    if (bytes < ARENA_MMAP_MIN) ::operator delete(p);
+    else munmap(p, mapped(bytes));
+  }
+
+  template<typename U>
+  void construct(U* p) noexcept(std::is_nothrow_default_constructible<U>::value) { ::new(static_cast<void*>(p)) U; }
+
+  template<typename U, typename... Args>
+  void construct(U* p, Args&&... args) { ::new(static_cast<void*>(p)) U(std::forward<Args>(args)...); }
+
+  static size_t mapped(size_t bytes) { return (bytes + ARENA_PAGE - 1) & ~(ARENA_PAGE - 1); }
+};
+
+template<typename T, typename U>
+bool operator==(const arena_allocator<T> &, const arena_allocator<U> &) { return true; }
+
+template<typename T, typename U>
+bool operator!=(const arena_allocator<T> &, const arena_allocator<U> &) { return false; }
+
+template<typename T>
+using arena_vector = std::vector<T, arena_allocator<T>>;
+
+/* reserves room for n entries, at most ARENA_MAX_BYTES; only address space until written */
+template<typename T>
+void arena_reserve(arena_vector<T> &v, uint64_t n) {
+  v.reserve(std::min<uint64_t>(n, ARENA_MAX_BYTES / sizeof(T)));
+}
+
+/* empties v and hands its pages back to the system, keeping the reservation */
+template<typename T>
+void arena_release(arena_vector<T> &v) {
+  const size_t bytes = v.capacity() * sizeof(T);
+  if (bytes >= ARENA_MMAP_MIN) madvise(v.data(), arena_allocator<T>::mapped(bytes), MADV_DONTNEED);
+  v.clear();
+}
+
+#endif
@@ -22,9 +22,13 @@
 #include "common.hpp"
 #include "kcounter.hpp"
 #include "ska_sort.hpp"
+#include "ktable.hpp"
+#include "query_batch.hpp"
 
 #include <mpi.h>
 #include <immintrin.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 uint64_t MurmurHash64A (uint64_t key, uint64_t seed) {
   const uint64_t m = 0xc6a4a7935bd1e995;
@@ -47,33 +51,117 @@ uint64_t MurmurHash64A (uint64_t key, uint64_t seed) {
   return h;
 }
 
-inline int owner_pe(kmer_t kmer) {
+uint64_t MurmurHash64A_inverse(uint64_t hash, uint64_t seed) {
+/*
+ * Every step of MurmurHash64A on one word is invertible (multiplications 
+ * by an odd constant, xorshifts by 47 >= 32 bits that undo themselves), 
+ * so the key is recovered by running them backwards.
+ */
+  const uint64_t m = 0xc6a4a7935bd1e995;
+  const int r = 47;
+
+  uint64_t minv = m; // inverse of m modulo 2^64, by Newton iteration
+  for (int i = 0; i < 5; i++) minv *= 2 - m * minv;
+
+  uint64_t h = hash;
+  h ^= h >> r;
+  h *= minv;
+  h ^= h >> r;
+  h *= minv;
+
+  uint64_t k = h ^ (seed ^ (8 * m));
+  k *= minv;
+  k ^= k >> r;
+  k *= minv;
+
+  return k;
+}
+
+/* seed of the hash behind the hot k-mer sketch and table */
+#define HOT_SEED 0x2545F4914F6CDD1DULL
+
+static std::vector<int> pe_nodes() {
+/*
+ * Node of every PE: blocks of NODE_PES consecutive PEs if set, else the 
+ * PEs sharing memory with MPI_COMM_TYPE_SHARED, named by their lowest rank.
+ */
+  int rank, npes, node;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &npes);
+
+  #if NODE_PES > 0
+  node = rank / NODE_PES;
+  #else
+  MPI_Comm comm;
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &comm);
+  MPI_Allreduce(&rank, &node, 1, MPI_INT, MPI_MIN, comm);
+  MPI_Comm_free(&comm);
+  #endif
+
+  std::vector<int> nodes(npes);
+  MPI_Allgather(&node, 1, MPI_INT, nodes.data(), 1, MPI_INT, MPI_COMM_WORLD);
+  return nodes;
+}
+
+template<typename kmer_type>
+inline int owner_pe(const kmer_type &kmer) {
   /* example of a randomly chosen 64-bit seed */
-  const uint64_t seed = 0x9E3779B97F4A7C15;
-  return MurmurHash64A(kmer, seed) % TOTAL_PE;
+  return hash_owner(kmer_hash(kmer, OWNER_SEED), TOTAL_PE);
 }
 
-int binary_search(const std::vector<kmer_packet> &arr, kmer_t kmer, int &left_, int right) {
+template<typename kmer_type, typename emit_fn>
+uint64_t join_counts(const kmer_type* dbg, uint64_t dbg_size, 
+    const kmer_packet<kmer_type>* heavy, uint64_t heavy_size, emit_fn emit) {
+/* the merge-join of merge_join_counts, emit(entry) takes the entries in order */
+  uint64_t i = 0, h = 0, joined = 0;
+
+  while (i < dbg_size) {
+    const kmer_type kmer = dbg[i];
+    count_t count = 1;
+    for (i++; i < dbg_size && dbg[i] == kmer; i++) count++;
+
+    while (h < heavy_size && heavy[h].kmer < kmer) emit(heavy[h++]);
+    if (h < heavy_size && heavy[h].kmer == kmer) {
+      count += heavy[h++].count;
+      joined++;
+    }
+    emit(kmer_packet<kmer_type>{kmer, count});
+  }
+  while (h < heavy_size) emit(heavy[h++]);
 
-  auto it = std::lower_bound(arr.begin() + left_, arr.begin() + right + 1, kmer, 
-    [](const kmer_packet &pkt, kmer_t kmer) {
-      return pkt.kmer < kmer;
-  });
+  return joined;
+}
 
-  if (it != arr.begin() + right + 1 && it->kmer == kmer) {
-    left_ = std::distance(arr.begin(), it);
-    return left_;
+template<typename kmer_type>
+uint64_t merge_join_counts(const kmer_type* dbg, uint64_t dbg_size, 
+    const kmer_packet<kmer_type>* heavy, uint64_t heavy_size, 
+    arena_vector<kmer_packet<kmer_type>> &out) {
+/*
+ * One pass over the sorted received k-mers and the sorted, merged heavy 
+ * hitter counts: runs of equal k-mers are counted and joined with the 
+ * heavy entry of the same k-mer, if any, and the union of both tables 
+ * is appended to out as one sorted (k-mer, count) array. Returns the 
+ * number of k-mers found in both tables.
+ */
+  uint64_t runs = (dbg_size > 0);
+
+  /* a streaming count of the runs sizes the output, the join then never 
+     reallocates (growth stays geometric over many appends) */
+  for (uint64_t j = 1; j < dbg_size; j++) runs += (dbg[j] != dbg[j - 1]);
+  if (out.size() + runs + heavy_size > out.capacity()) {
+    out.reserve(std::max<uint64_t>(2 * out.capacity(), out.size() + runs + heavy_size));
   }
 
-  return -1;
+  return join_counts(dbg, dbg_size, heavy, heavy_size, [&out](const kmer_packet<kmer_type> &pkt) {out.push_back(pkt);});
 }
 
-void sort_and_merge_duplicate_kmer_packets(std::vector<kmer_packet> &vec, uint32_t &size) {
+template<typename kmer_type>
+void sort_and_merge_duplicate_kmer_packets(arena_vector<kmer_packet<kmer_type>> &vec, uint64_t &size) {
 
   if (__builtin_expect(size == 0, 0)) return;
 
   /* First sort the vector */
-  ska_sort(vec.begin(), vec.begin() + size, [](const kmer_packet &a) {return a.kmer;});
+  ska_sort(vec.begin(), vec.begin() + size, [](const kmer_packet<kmer_type> &a) {return radix_key(a.kmer);});
 
   /* using iterators to make the code more efficient */
   auto it = vec.begin();
@@ -82,7 +170,7 @@ void sort_and_merge_duplicate_kmer_packets(std::vector<kmer_packet> &vec, uint32
   /* output iterator, location at which we'll write */
   auto out_it = vec.begin();
 
-  kmer_packet curr_pkt = std::move(*it);
+  kmer_packet<kmer_type> curr_pkt = std::move(*it);
   it++;
 
   while (it != end) {
@@ -103,6 +191,88 @@ void sort_and_merge_duplicate_kmer_packets(std::vector<kmer_packet> &vec, uint32
   size = std::distance(vec.begin(), out_it) + 1;
 }
 
+template<int K, typename join_fn>
+uint64_t join_buckets(recv_buckets<K> &buckets, const kmer_packet<typename kmer_traits<K>::type>* heavy, 
+    uint64_t heavy_size, int nthreads, join_fn join, uint64_t &received, double &sort_time) {
+/*
+ * Sorts the received buckets in key order and hands each one, while it 
+ * is still in cache, with the heavy counts of its key range to 
+ * join(k-mers, size, heavy, heavy_size), then frees it. nthreads threads 
+ * sort that many buckets at a time and the joins follow. Returns the 
+ * heavy hitters joined; received is the number of k-mers in the buckets.
+ */
+  typedef typename kmer_traits<K>::type kmer_type;
+  std::vector<arena_vector<kmer_type>> &bucket = buckets.bucket;
+  const int nbuckets = bucket.size();
+  uint64_t h = 0, joined = 0;
+
+  received = 0;
+  sort_time = 0;
+  for (int b0 = 0; b0 < nbuckets; b0 += nthreads) {
+    const int b1 = std::min(nbuckets, b0 + nthreads);
+    double start = MPI_Wtime();
+
+    #pragma omp parallel for num_threads(nthreads) schedule(static, 1)
+    for (int b = b0; b < b1; b++) {
+      ska_sort(bucket[b].begin(), bucket[b].end(), [](const kmer_type &a) {return radix_key(a);});
+    }
+    sort_time += MPI_Wtime() - start;
+
+    for (int b = b0; b < b1; b++) {
+      uint64_t h_end = h;
+      while (h_end < heavy_size && recv_buckets<K>::prefix(heavy[h_end].kmer) <= static_cast<uint64_t>(b)) h_end++;
+      joined += join(bucket[b].data(), bucket[b].size(), heavy + h, h_end - h);
+      received += bucket[b].size();
+      h = h_end;
+      buckets.release(b);
+    }
+  }
+  return joined;
+}
+
+template<int K>
+void spill_received(arena_vector<typename kmer_traits<K>::type> &dbg, uint64_t dbg_size, 
+    arena_vector<kmer_packet<typename kmer_traits<K>::type>> *heavydbg, uint64_t heavy_size, 
+    recv_buckets<K> *buckets, recv_table<typename kmer_traits<K>::type> *table, 
+    spill_runs<kmer_packet<typename kmer_traits<K>::type>> &spill) {
+/*
+ * --mem-limit: the received k-mers (the first dbg_size of dbg, or the 
+ * buckets) and the heavy counts are counted into one sorted run on disk 
+ * the way perform_kcount counts them at the end, the table's counts into 
+ * a run of their own. Empties the arrays (keeping their reservations), 
+ * the buckets and the table.
+ */
+  typedef typename kmer_traits<K>::type kmer_type;
+  auto join = [&spill](const kmer_type* kmers, uint64_t n, const kmer_packet<kmer_type>* heavy, uint64_t nheavy) {
+    return join_counts(kmers, n, heavy, nheavy, [&spill](const kmer_packet<kmer_type> &pkt) {spill.put(pkt);});
+  };
+
+  if (heavydbg) sort_and_merge_duplicate_kmer_packets(*heavydbg, heavy_size);
+  const kmer_packet<kmer_type>* heavy = heavydbg ? heavydbg->data() : NULL;
+
+  spill.begin();
+  if (buckets) {
+    uint64_t received;
+    double sort_time;
+    join_buckets(*buckets, heavy, heavy_size, 1, join, received, sort_time);
+  } else {
+    ska_sort(dbg.begin(), dbg.begin() + dbg_size, [](const kmer_type &a) {return radix_key(a);});
+    join(dbg.data(), dbg_size, heavy, heavy_size);
+  }
+  spill.end();
+  arena_release(dbg);
+  if (heavydbg) arena_release(*heavydbg);
+
+  if (table && table->size > 0) {
+    kmer_packet<kmer_type>* run = table->compact();
+    ska_sort(run, run + table->size, [](const kmer_packet<kmer_type> &a) {return radix_key(a.kmer);});
+    spill.begin();
+    for (uint64_t i = 0; i < table->size; i++) spill.put(run[i]);
+    spill.end();
+    table->clear();
+  }
+}
+
 #if 0
 void simd_transfer(const kmer_t* src, kmer_t* dest, 
   uint32_t dest_start, uint32_t src_size) {
@@ -120,37 +290,234 @@ void simd_transfer(const kmer_t* src, kmer_t* dest,
 #endif
 
 // Message Handler -------------------------------------------------------------
-void kmer_handler::recv_kmer(bigk_packet pkt, int sender_pe) {
-  if (__builtin_expect(pkt.type == NORMAL, 1)) {
-    if (__builtin_expect(dbg_size + pkt.size > dbg_->size(), 0)) {
-      dbg_->resize(2 * dbg_size);
-    }
+template<int K, int BIGK>
+void kmer_handler<K, BIGK>::recv_kmer(packet_type pkt, int sender_pe) {
+  npkts++;
+  remote_pkts += ((*pe_node_)[sender_pe] != my_node_);
+  if (__builtin_expect(pkt.type == NORMAL, 1) && table_) {
+    tally(pkt.kmers, NULL, pkt.size);
+  } else if (pkt.type == NORMAL && buckets_) {
+    for (int i = 0; i < pkt.size; i++) buckets_->add(pkt.kmers[i]);
+  } else if (pkt.type == NORMAL) {
+    if (__builtin_expect(dbg_size + pkt.size > dbg_->size(), 0)) make_room(*dbg_, dbg_size, pkt.size);
     // simd_transfer(&pkt.kmers[0], dbg_->data(), dbg_size, pkt.size);
     for (int i = 0; i < pkt.size; i++) {
       (*dbg_)[dbg_size + i] = pkt.kmers[i];
     }
     dbg_size += pkt.size;
+  } else if (pkt.type == SUPER) {
+    recv_superkmers(pkt);
+  } else if (pkt.type == CODED) {
+    recv_coded(pkt);
+  } else if (pkt.type == TRANSIT || pkt.type == TRANSIT_HEAVY) {
+    recv_transit(pkt);
+  } else if (table_) {
+    count_t counts[packet_type::HEAVY_CAP];
+    for (int i = 0; i < pkt.size; i++) counts[i] = pkt.get_count(i);
+    tally(pkt.kmers, counts, pkt.size);
   } else { // HEAVY HITTER TYPE PACKET
-    if (__builtin_expect(heavydbg_size + pkt.size > heavydbg_->size(), 0)) {
-      heavydbg_->resize(2 * heavydbg_size);
-    }
+    if (__builtin_expect(heavydbg_size + pkt.size > heavydbg_->size(), 0)) make_room(*heavydbg_, heavydbg_size, pkt.size);
 
     for (int i = 0; i < pkt.size; i++) {
-      (*heavydbg_)[heavydbg_size + i] = {pkt.kmers[i], pkt.kmers[BIGKSIZE + i]};
+      (*heavydbg_)[heavydbg_size + i] = {pkt.kmers[i], pkt.get_count(i)};
     }
     
     heavydbg_size += pkt.size;
   }
+
+  /* the arrays stop growing at the limit, the buckets are checked here */
+  if (__builtin_expect(spill_ != NULL, 0) && buckets_ && recv_bytes() > spill_->limit) spill();
+}
+
+template<int K, int BIGK>
+void kmer_handler<K, BIGK>::recv_superkmers(const packet_type &pkt) {
+/*
+ * Unpacks the super-k-mers of a SUPER packet and appends their k-mers 
+ * (canonical if set) to the received k-mers, as NORMAL packets would.
+ */
+  typedef kmercounter<K, BIGK> counter;
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(pkt.kmers);
+  uint8_t bases[256];
+  kmer_type expanded[256]; // the k-mers of one super-k-mer, with buckets or a table
+
+  for (int pos = 0; pos < pkt.size; ) {
+    const int nbases = data[pos];
+    for (int i = 0; i < nbases; i++) {
+      bases[i] = (data[pos + 1 + i / 4] >> (6 - 2 * (i % 4))) & 0x3;
+    }
+    pos += 1 + (nbases + 3) / 4;
+
+    const int nkmers = nbases - K + 1;
+    const bool direct = !buckets_ && !table_;
+    if (direct && dbg_size + nkmers > dbg_->size()) make_room(*dbg_, dbg_size, nkmers);
+
+    kmer_type* out = direct ? dbg_->data() + dbg_size : expanded;
+    kmer_type kmer = counter::set_kmer_fast(bases);
+    if (canonical_) {
+      kmer_type rc = counter::set_rc_fast(bases);
+      out[0] = counter::canonical_kmer(kmer, rc);
+      for (int i = 1; i < nkmers; i++) {
+        kmer = counter::update_kmer_fast(kmer, bases[i + K - 1]);
+        rc = counter::update_rc_fast(rc, bases[i + K - 1]);
+        out[i] = counter::canonical_kmer(kmer, rc);
+      }
+    } else {
+      out[0] = kmer;
+      for (int i = 1; i < nkmers; i++) {
+        kmer = counter::update_kmer_fast(kmer, bases[i + K - 1]);
+        out[i] = kmer;
+      }
+    }
+
+    if (table_) {
+      tally(out, NULL, nkmers);
+    } else if (buckets_) {
+      for (int i = 0; i < nkmers; i++) buckets_->add(out[i]);
+    } else {
+      dbg_size += nkmers;
+    }
+  }
+}
+
+template<int K, int BIGK>
+void kmer_handler<K, BIGK>::recv_coded(const packet_type &pkt) {
+/*
+ * Decodes a CODED frame: every key is an owner hash minus the first hash 
+ * of this PE's range, and the hash inverts back to the k-mer.
+ */
+  if constexpr (std::is_same<kmer_type, uint64_t>::value) {
+    const uint64_t first_hash = owner_first_hash(CURR_PE, TOTAL_PE);
+
+    codec_->decode(reinterpret_cast<const uint8_t*>(pkt.kmers), pkt.size, [&](uint64_t key, int count) {
+      kmer_type kmer = MurmurHash64A_inverse(first_hash + key, OWNER_SEED);
+      if (table_) {
+        const count_t c = count;
+        tally(&kmer, &c, 1);
+        return;
+      }
+      if (buckets_) {
+        for (int i = 0; i < count; i++) buckets_->add(kmer);
+        return;
+      }
+      if (__builtin_expect(dbg_size + count > dbg_->size(), 0)) make_room(*dbg_, dbg_size, count);
+      for (int i = 0; i < count; i++) (*dbg_)[dbg_size + i] = kmer;
+      dbg_size += count;
+    });
+  }
+}
+
+template<int K, int BIGK>
+void kmer_handler<K, BIGK>::tally(const kmer_type* kmers, const count_t* counts, int n) {
+/*
+ * -r hash: the slots of n received k-mers (one copy each without counts) 
+ * are hashed and prefetched before any is counted, so the probes of a 
+ * packet overlap. Copies of new k-mers the full table refuses are stored 
+ * for sorting instead.
+ */
+  uint64_t hash[256];
+  assert(n <= 256);
+
+  for (int i = 0; i < n; i++) {
+    hash[i] = kmer_hash(kmers[i], TABLE_SEED);
+    table_->prefetch(hash[i]);
+  }
+  for (int i = 0; i < n; i++) {
+    const count_t count = counts ? counts[i] : 1;
+    if (!table_->add(kmers[i], hash[i], count)) store(kmers[i], count);
+  }
+}
+
+template<int K, int BIGK>
+void kmer_handler<K, BIGK>::store(const kmer_type &kmer, count_t count) {
+/* sorting path of one k-mer: a copy goes to the received k-mers, a run to the heavy counts */
+  if (count > 1) {
+    if (heavydbg_size + 1 > heavydbg_->size()) make_room(*heavydbg_, heavydbg_size, 1);
+    (*heavydbg_)[heavydbg_size++] = {kmer, count};
+  } else if (buckets_) {
+    buckets_->add(kmer);
+  } else {
+    if (dbg_size + 1 > dbg_->size()) make_room(*dbg_, dbg_size, 1);
+    (*dbg_)[dbg_size++] = kmer;
+  }
+}
+
+template<int K, int BIGK>
+template<typename T>
+void kmer_handler<K, BIGK>::make_room(arena_vector<T> &v, uint64_t &used, uint64_t n) {
+/*
+ * Grows a receive array (the k-mers or the heavy counts) to hold n more 
+ * entries after the used ones. It doubles, but with --mem-limit only as 
+ * far as the memory of the other arrays leaves room for, and once n more 
+ * do not fit there the received k-mers are spilled first.
+ */
+  uint64_t size = 2 * used + n;
+  if (spill_) {
+    auto room = [&]() {
+      const uint64_t others = recv_bytes() - v.size() * sizeof(T);
+      return (spill_->limit > others) ? (spill_->limit - others) / sizeof(T) : 0;
+    };
+    if (used + n > room()) spill();
+    if (used + n <= v.size()) return;
+    size = std::max<uint64_t>(used + n, std::min<uint64_t>(size, room()));
+  }
+  v.reserve(size); // exactly size, a resize alone may double the capacity
+  v.resize(size); // within the presized arena, neither copies nor touches the new pages
+}
+
+template<int K, int BIGK>
+void kmer_handler<K, BIGK>::spill() {
+  spill_received<K>(*dbg_, dbg_size, heavydbg_, heavydbg_size, buckets_, table_, *spill_);
+  dbg_size = 0;
+  heavydbg_size = 0;
+}
+
+template<int K, int BIGK>
+void kmer_handler<K, BIGK>::recv_transit(const packet_type &pkt) {
+/* node aggregation: k-mers this PE combines and forwards to another node */
+  if (pkt.type == TRANSIT) {
+    if (transit_->nkmers + pkt.size > transit_->kmers.size()) {
+      transit_->kmers.resize(2 * transit_->nkmers + pkt.size);
+    }
+    for (int i = 0; i < pkt.size; i++) transit_->kmers[transit_->nkmers + i] = pkt.kmers[i];
+    transit_->nkmers += pkt.size;
+  } else {
+    if (transit_->nruns + pkt.size > transit_->runs.size()) {
+      transit_->runs.resize(2 * transit_->nruns + pkt.size);
+    }
+    for (int i = 0; i < pkt.size; i++) transit_->runs[transit_->nruns + i] = {pkt.kmers[i], pkt.get_count(i)};
+    transit_->nruns += pkt.size;
+  }
+}
+
+template<int K, int BIGK>
+void query_handler<K, BIGK>::recv_query(packet_type pkt, int sender_pe) {
+  for (int i = 0; i < pkt.size; i++) {
+    count_t count = table_->lookup(pkt.kmers[i]);
+    found += (count > 0);
+    pkt.set_count(i, count);
+  }
+  served += pkt.size;
+  this->send(REPLY, pkt, sender_pe);
+}
+
+template<int K, int BIGK>
+void query_handler<K, BIGK>::recv_reply(packet_type pkt, int sender_pe) {
+  for (int i = 0; i < pkt.size; i++) {
+    (*counts_)[pkt.ids[i]] = pkt.get_count(i);
+  }
 }
 
-void init_packets(std::vector<bigk_packet> &pkt_vec, int type) {
+template<typename packet_type>
+void init_packets(std::vector<packet_type> &pkt_vec, int type) {
   for (int i = 0; i < TOTAL_PE; i++) {
     pkt_vec[i].size = 0;
     pkt_vec[i].type = type;
   }
 }
 
-void empty_packets(std::vector<bigk_packet> &pkt_vec, kmer_handler* kmer_selector) {
+template<int K, int BIGK>
+void empty_packets(std::vector<typename kmer_handler<K, BIGK>::packet_type> &pkt_vec, 
+    kmer_handler<K, BIGK>* kmer_selector) {
   for (int i = 0; i < TOTAL_PE; i++) {
     if (pkt_vec[i].size > 0) {
       kmer_selector->send(PUT, pkt_vec[i], i);
@@ -159,37 +526,38 @@ void empty_packets(std::vector<bigk_packet> &pkt_vec, kmer_handler* kmer_selecto
   }
 }
 
-void inline add_in_normal_packet(std::vector<bigk_packet_type> &normal_vec, kmer_t kmer, 
-    kmer_handler* kmer_selector) {
-  int owner = owner_pe(kmer);
-  bigk_packet &bigpkt = normal_vec[owner];
+template<int K, int BIGK, typename packet_type, typename kmer_type>
+void inline add_in_normal_packet(std::vector<packet_type> &normal_vec, const kmer_type &kmer, int owner, 
+    kmer_handler<K, BIGK>* kmer_selector) {
+  packet_type &bigpkt = normal_vec[owner];
 
   bigpkt.kmers[bigpkt.size] = kmer;
   bigpkt.size++;
 
-  if (bigpkt.size == BIGKSIZE * 2) {
+  if (bigpkt.size == packet_type::NORMAL_CAP) {
     kmer_selector->send(PUT, bigpkt, owner);
     bigpkt.size = 0;
   }
 }
 
-void inline add_in_heavy_packet(std::vector<bigk_packet_type> &heavy_vec, kmer_t kmer, 
-    count_t count, kmer_handler* kmer_selector) {
-  int owner = owner_pe(kmer);
-  bigk_packet &bigpkt = heavy_vec[owner];
+template<int K, int BIGK, typename packet_type, typename kmer_type>
+void inline add_in_heavy_packet(std::vector<packet_type> &heavy_vec, const kmer_type &kmer, 
+    count_t count, int owner, kmer_handler<K, BIGK>* kmer_selector) {
+  packet_type &bigpkt = heavy_vec[owner];
 
   bigpkt.kmers[bigpkt.size] = kmer;
-  bigpkt.kmers[BIGKSIZE + bigpkt.size] = count;
+  bigpkt.set_count(bigpkt.size, count);
   bigpkt.size++;
 
-  if (bigpkt.size == BIGKSIZE) {
+  if (bigpkt.size == packet_type::HEAVY_CAP) {
     kmer_selector->send(PUT, bigpkt, owner);
     bigpkt.size = 0;
   }
 }
 
-void send2sendbuf(kmer_t curr_kmer, count_t curr_count, kmer_handler* kmer_selector, 
-  std::vector<bigk_packet_type> &hitter_vec, std::vector<bigk_packet_type> &normal_vec) {
+template<int K, int BIGK, typename packet_type, typename kmer_type>
+void send2sendbuf(const kmer_type &curr_kmer, count_t curr_count, int owner, kmer_handler<K, BIGK>* kmer_selector, 
+  std::vector<packet_type> &hitter_vec, std::vector<packet_type> &normal_vec) {
 
   #if DEBUG 
   assert(curr_count > 0);
@@ -197,104 +565,484 @@ void send2sendbuf(kmer_t curr_kmer, count_t curr_count, kmer_handler* kmer_selec
   
   switch (curr_count) {
     case 1:
-      add_in_normal_packet(normal_vec, curr_kmer, kmer_selector);
+      add_in_normal_packet(normal_vec, curr_kmer, owner, kmer_selector);
       break;
     case 2:
-      add_in_normal_packet(normal_vec, curr_kmer, kmer_selector);
-      add_in_normal_packet(normal_vec, curr_kmer, kmer_selector);
+      add_in_normal_packet(normal_vec, curr_kmer, owner, kmer_selector);
+      add_in_normal_packet(normal_vec, curr_kmer, owner, kmer_selector);
       break;
     default:
-      add_in_heavy_packet(hitter_vec, curr_kmer, curr_count, kmer_selector);
+      add_in_heavy_packet(hitter_vec, curr_kmer, curr_count, owner, kmer_selector);
       break;
   }
 }
 
-void kmercounter::flush_buffer(std::vector<kmer_t> &kcount_buffer, uint64_t &kmers_in_buffer,
-    kmer_handler* kmer_selector,std::vector<bigk_packet_type> &hitter_vec, 
-    std::vector<bigk_packet_type> &normal_vec) {
-  
-  int i, owner; 
-  kmer_t kmer;
-
-  #if !HITTER
-  for (i = 0; i < kmers_in_buffer; i++) {
-    kmer = kcount_buffer[i];
-    add_in_normal_packet(normal_vec, kmer, kmer_selector);
+template<int K, int BIGK>
+inline void kmercounter<K, BIGK>::send_kmer(const kmer_type &kmer, count_t count, int owner, 
+    kmer_handler<K, BIGK>* kmer_selector, std::vector<packet_type> &hitter_vec, 
+    std::vector<packet_type> &normal_vec) {
+/* with node aggregation, k-mers owned on another node go through route[owner] */
+  if (node_agg && route[owner] != owner) {
+    send2sendbuf(kmer, count, route[owner], kmer_selector, transit_heavy_pkts, transit_pkts);
+    forwarded += count;
+    return;
   }
+  send2sendbuf(kmer, count, owner, kmer_selector, hitter_vec, normal_vec);
+}
+
+template<int K, int BIGK>
+void kmercounter<K, BIGK>::send_hot(kmer_handler<K, BIGK>* kmer_selector, std::vector<packet_type> &hitter_vec) {
+  #if HITTER_SKETCH
+  hot->drain([&](const kmer_type &kmer, count_t count) {
+    int owner = owner_pe(kmer);
+    if (node_agg && route[owner] != owner) {
+      add_in_heavy_packet(transit_heavy_pkts, kmer, count, route[owner], kmer_selector);
+      forwarded += count;
+    } else {
+      add_in_heavy_packet(hitter_vec, kmer, count, owner, kmer_selector);
+    }
+  });
   #endif
+}
+
+template<int K, int BIGK>
+void kmercounter<K, BIGK>::send_superkmers(kmer_handler<K, BIGK>* kmer_selector, std::vector<packet_type> &normal_vec) {
+/*
+ * Moves the staged super-k-mers into the SUPER packets of their owners, 
+ * a packet is sent once the next super-k-mer does not fit.
+ */
+  size_t pos = 0;
+  int owner;
+
+  while (pos < super_buf.size()) {
+    memcpy(&owner, &super_buf[pos], sizeof(int));
+    pos += sizeof(int);
+
+    const int nbytes = 1 + (super_buf[pos] + 3) / 4;
+    packet_type &bigpkt = normal_vec[owner];
+    if (bigpkt.size + nbytes > packet_type::PAYLOAD_BYTES) {
+      kmer_selector->send(PUT, bigpkt, owner);
+      bigpkt.size = 0;
+    }
+
+    memcpy(reinterpret_cast<uint8_t*>(bigpkt.kmers) + bigpkt.size, &super_buf[pos], nbytes);
+    bigpkt.size += nbytes;
+    pos += nbytes;
+  }
+  super_buf.clear();
+}
+
+template<int K, int BIGK>
+void kmercounter<K, BIGK>::add_in_coded_packet(std::vector<packet_type> &coded_vec, uint64_t hash, 
+    count_t count, kmer_handler<K, BIGK>* kmer_selector) {
+  const uint64_t npes = TOTAL_PE;
+  const __uint128_t scaled = static_cast<__uint128_t>(hash) * npes;
+  const int owner = static_cast<int>(scaled >> 64);
+  const uint64_t key = static_cast<uint64_t>(scaled) / npes; // hash - owner_first_hash(owner)
+  packet_type &bigpkt = coded_vec[owner];
+  frame_cursor &frame = frames[owner];
+  uint8_t* data = reinterpret_cast<uint8_t*>(bigpkt.kmers);
+
+  while (count > 0) {
+    int n = std::min<count_t>(count, CODEC_MAX_COUNT);
+    if (frame.bits + codec->entry_bits(frame, key, n) > 8 * packet_type::PAYLOAD_BYTES) {
+      kmer_selector->send(PUT, bigpkt, owner);
+      bigpkt.size = 0;
+      key_codec::reset(data, packet_type::PAYLOAD_BYTES, frame, codec->rice_bits);
+    }
+    codec->put(data, frame, key, n);
+    bigpkt.size++;
+    count -= n;
+  }
+}
+
+template<int K, int BIGK>
+void kmercounter<K, BIGK>::flush_coded(std::vector<kmer_type> &kcount_buffer, uint64_t kmers_in_buffer, 
+    kmer_handler<K, BIGK>* kmer_selector, std::vector<packet_type> &hitter_vec, 
+    std::vector<packet_type> &coded_vec) {
+/*
+ * Codec mode flush: the buffer is replaced by the owner hashes of its 
+ * k-mers (a bijection) and sorted, so the keys of every destination come 
+ * in increasing order and each run of equal k-mers becomes one (key, 
+ * count) entry of its frame. With hitter, hot and heavy k-mers still take 
+ * the HEAVY packets.
+ */
+  if constexpr (CODEC_KEYS) {
+    if (kmers_in_buffer == 0) return;
+
+    hash_kmers64(kcount_buffer.data(), kmers_in_buffer, OWNER_SEED, kcount_buffer.data());
+    if (rounds > 1) {
+      uint64_t kept = 0;
+      for (uint64_t i = 0; i < kmers_in_buffer; i++) {
+        if (hash_round(kcount_buffer[i], TOTAL_PE, rounds) == round) kcount_buffer[kept++] = kcount_buffer[i];
+      }
+      kmers_in_buffer = kept;
+    }
+    ska_sort(kcount_buffer.begin(), kcount_buffer.begin() + kmers_in_buffer);
+
+    for (uint64_t i = 0, j; i < kmers_in_buffer; i = j) {
+      const uint64_t hash = kcount_buffer[i];
+      for (j = i + 1; j < kmers_in_buffer && kcount_buffer[j] == hash; j++);
+      const count_t count = j - i;
+
+      if (hitter) {
+        kmer_type kmer = MurmurHash64A_inverse(hash, OWNER_SEED);
+        #if HITTER_SKETCH
+        if (hot->add(kmer, kmer_hash(kmer, HOT_SEED), count)) continue;
+        #endif
+        if (count >= 3) {
+          add_in_heavy_packet(hitter_vec, kmer, count, owner_pe(kmer), kmer_selector);
+          continue;
+        }
+      }
+      add_in_coded_packet(coded_vec, hash, count, kmer_selector);
+    }
+
+    #if HITTER_SKETCH
+    if (hitter && ++nflushes % HOT_FLUSH_INTERVAL == 0) send_hot(kmer_selector, hitter_vec);
+    #endif
+  }
+}
 
-  #if HITTER
-  ska_sort(kcount_buffer.begin(), kcount_buffer.begin() + kmers_in_buffer);
-  kmer_t curr_kmer = kcount_buffer[0];
-  count_t curr_count = 1;
+template<int K, int BIGK>
+void kmercounter<K, BIGK>::flush_buffer(kcount_worker<kmer_type> &w, kmer_handler<K, BIGK>* kmer_selector, 
+    std::vector<packet_type> &hitter_vec, std::vector<packet_type> &normal_vec) {
+/*
+ * Sends the buffer of the (only) worker. By default it is grouped by owner 
+ * (into runs first, with hitter) by stage_buffer in one batched pass, and 
+ * send_staged copies every group into the packets of its destination.
+ */
+  if (minimizer) {
+    send_superkmers(kmer_selector, normal_vec);
+  } else if (codec) {
+    flush_coded(w.buf, w.kmers_in_buffer, kmer_selector, hitter_vec, normal_vec);
+  } else {
+    stage_buffer(w, TOTAL_PE);
+    send_staged(kmer_selector, hitter_vec, normal_vec);
+  }
+  w.kmers_in_buffer = 0;
+}
 
-  /* For every packet I send to the heavy buffer, I send a single packet to the normal buffer */
-  /* Hence, all the kmers in heavy dbg should already be there in the normal dbg*/
-  for (i = 1; i < kmers_in_buffer; i++) {
-    if (kcount_buffer[i] == curr_kmer) {
-      curr_count++;
+template<int K, int BIGK>
+void kmercounter<K, BIGK>::split_window() {
+/*
+ * Threaded mode: cuts the window into one range of whole reads per 
+ * worker, the i-th ending at the first newline past i / nthreads of it.
+ */
+  uint64_t start = 0;
+
+  for (int t = 0; t < nthreads; t++) {
+    uint64_t end = rchunk_len;
+    if (t + 1 < nthreads) {
+      end = std::max(start, rchunk_len * (t + 1) / nthreads);
+      const char* nl = static_cast<const char*>(memchr(rchunk + end, '\n', rchunk_len - end));
+      end = nl ? (nl - rchunk) + 1 : rchunk_len;
+    }
+    workers[t].read_idx = start;
+    workers[t].read_end = end;
+    workers[t].done_parsing = (start >= end);
+    start = end;
+  }
+}
+
+template<int K, int BIGK>
+void kmercounter<K, BIGK>::stage_buffer(kcount_worker<kmer_type> &w, int npes) const {
+/*
+ * Run by every worker on its own buffer: with hitter, sorts it into runs 
+ * of equal k-mers; then groups the k-mers (runs) by owner PE with a 
+ * counting sort, so the communication thread only copies them into the 
+ * packets of their destination. The owners of the whole buffer are 
+ * hashed in one batch (vectorized for 64-bit k-mers), before the 
+ * histogram and the scatter passes.
+ */
+  uint64_t n = w.kmers_in_buffer;
+  std::vector<kmer_type> &buf = w.buf;
+
+  if (rounds > 1) {
+    /* -R: owners over npes * rounds virtual PEs, v % rounds is hash_round */
+    w.owners.resize(n);
+    if constexpr (std::is_same<kmer_type, uint64_t>::value) {
+      owner_pes64(buf.data(), n, OWNER_SEED, npes * rounds, w.owners.data());
     } else {
-      send2sendbuf(curr_kmer, curr_count, kmer_selector, hitter_vec, normal_vec);
-      curr_kmer = kcount_buffer[i];
-      curr_count = 1;
+      for (uint64_t i = 0; i < n; i++) w.owners[i] = hash_owner(kmer_hash(buf[i], OWNER_SEED), npes * rounds);
+    }
+    uint64_t kept = 0;
+    for (uint64_t i = 0; i < n; i++) {
+      if (w.owners[i] % rounds == round) buf[kept++] = buf[i];
     }
+    n = kept;
   }
-  send2sendbuf(curr_kmer, curr_count, kmer_selector, hitter_vec, normal_vec);
-  
+
+  if (hitter && n > 0) {
+    ska_sort(buf.begin(), buf.begin() + n, [](const kmer_type &a) {return radix_key(a);});
+    w.counts.resize(n);
+    uint64_t runs = 0;
+    for (uint64_t i = 0, j; i < n; i = j) {
+      for (j = i + 1; j < n && buf[j] == buf[i]; j++);
+      buf[runs] = buf[i];
+      w.counts[runs++] = j - i;
+    }
+    n = runs;
+  }
+
+  w.owners.resize(n);
+  if constexpr (std::is_same<kmer_type, uint64_t>::value) {
+    owner_pes64(buf.data(), n, OWNER_SEED, npes, w.owners.data());
+  } else {
+    for (uint64_t i = 0; i < n; i++) w.owners[i] = hash_owner(kmer_hash(buf[i], OWNER_SEED), npes);
+  }
+
+  std::fill(w.first.begin(), w.first.end(), 0);
+  for (uint64_t i = 0; i < n; i++) w.first[w.owners[i] + 1]++;
+  for (int p = 0; p < npes; p++) w.first[p + 1] += w.first[p];
+
+  // first[p] is the cursor of PE p during the scatter, then shifted back
+  w.staged.resize(n);
+  if (hitter) w.staged_counts.resize(n);
+  for (uint64_t i = 0; i < n; i++) {
+    uint32_t at = w.first[w.owners[i]]++;
+    w.staged[at] = buf[i];
+    if (hitter) w.staged_counts[at] = w.counts[i];
+  }
+  for (int p = npes; p > 0; p--) w.first[p] = w.first[p - 1];
+  w.first[0] = 0;
+  w.kmers_in_buffer = 0;
+}
+
+template<int K, int BIGK>
+void kmercounter<K, BIGK>::send_staged(kmer_handler<K, BIGK>* kmer_selector, 
+    std::vector<packet_type> &hitter_vec, std::vector<packet_type> &normal_vec) {
+/*
+ * Threaded mode, run by the communication thread after a parsing round: 
+ * drains the staging of all workers into the one set of packets of this 
+ * PE, destination by destination, so the packets of a PE fill up T times 
+ * as fast as with one thread.
+ */
+  for (int p = 0; p < TOTAL_PE; p++) {
+    for (kcount_worker<kmer_type> &w : workers) {
+      for (uint32_t i = w.first[p]; i < w.first[p + 1]; i++) {
+        if (!hitter) {
+          send_kmer(w.staged[i], 1, p, kmer_selector, hitter_vec, normal_vec);
+          continue;
+        }
+        #if HITTER_SKETCH
+        if (hot->add(w.staged[i], kmer_hash(w.staged[i], HOT_SEED), w.staged_counts[i])) continue;
+        #endif
+        send_kmer(w.staged[i], w.staged_counts[i], p, kmer_selector, hitter_vec, normal_vec);
+      }
+    }
+  }
+
+  #if HITTER_SKETCH
+  if (hitter && ++nflushes % HOT_FLUSH_INTERVAL == 0) send_hot(kmer_selector, hitter_vec);
   #endif
 }
 
-void kmercounter::perform_kcount() {
+template<int K, int BIGK>
+void kmercounter<K, BIGK>::forward_transit(uint64_t &npkts, uint64_t &remote_pkts) {
 /*
- * the main function of kmercounter class that takes the input vector 
- * and build the de bruijn graph in terms of a lookup table (implicitly)
- */ 
-  double starttime, endtime, localtime, globaltime;
+ * Second level of the node aggregation: the k-mers the PEs of this node 
+ * forwarded here are sort-merged into one (k-mer, count) run each, and 
+ * the runs sent to their owners on the other nodes, so a k-mer crosses 
+ * the network once per node rather than once per copy.
+ */
+  uint64_t nruns = transit->nruns;
+  ska_sort(transit->kmers.begin(), transit->kmers.begin() + transit->nkmers, 
+    [](const kmer_type &a) {return radix_key(a);});
+  sort_and_merge_duplicate_kmer_packets(transit->runs, nruns);
+
+  arena_vector<kmer_packet<kmer_type>> combined;
+  merge_join_counts(transit->kmers.data(), transit->nkmers, transit->runs.data(), nruns, combined);
+  delete transit; // free the memory
+  transit = NULL;
+
+  kmer_handler<K, BIGK>* kmer_selector = new kmer_handler<K, BIGK>(vectordbg, heavydbg, canonical, codec, NULL, buckets, table, spill, &pe_node);
+  kmer_selector->resume();
+
+  hclib::finish([=, &combined]() {
+    std::vector<packet_type> normal_vec(TOTAL_PE), heavy_vec(TOTAL_PE);
+    init_packets(normal_vec, NORMAL);
+    init_packets(heavy_vec, HEAVY);
 
-  if (CURR_PE == 0) {
-    #if HITTER
-    std::cout << "HITTER flag in ON " << std::endl;
-    #else 
-    std::cout << "HITTER flag in OFF " << std::endl;
+    kmer_selector->start();
+    for (const kmer_packet<kmer_type> &run : combined) {
+      send2sendbuf(run.kmer, run.count, owner_pe(run.kmer), kmer_selector, heavy_vec, normal_vec);
+    }
+    empty_packets(normal_vec, kmer_selector);
+    empty_packets(heavy_vec, kmer_selector);
+
+    kmer_selector->done(PUT);
+  });
+
+  npkts += kmer_selector->npkts;
+  remote_pkts += kmer_selector->remote_pkts;
+  delete kmer_selector;
+}
+
+template<int K, int BIGK>
+uint64_t kmercounter<K, BIGK>::expected_kmers(uint64_t estimate) const {
+/*
+ * The k-mers a PE is expected to receive in one round: the -e estimate 
+ * of its k-mers if there is one (estimate), else from the input size. 
+ * A read of READLEN bases takes READLEN + 1 bytes of a FASTA or text file 
+ * and twice that of a FASTQ file (headers left out, which errs on the 
+ * large side) and yields READLEN - K + 1 k-mers. The owner hash spreads 
+ * them evenly over the PEs and rounds, a quarter more is allowed for the 
+ * imbalance. 0 if the input can not be stat'ed.
+ */
+  uint64_t kmers = estimate / rounds;
+  if (!estimate) {
+    struct stat sb;
+    if (stat(reader->filename.c_str(), &sb) != 0 || READLEN < K) return 0;
+
+    const uint64_t bytes = static_cast<uint64_t>(sb.st_size) * (reader->is_gz ? ARENA_GZ_RATIO : 1);
+    const uint64_t reads = bytes / ((reader->is_fq ? 2 : 1) * (READLEN + 1));
+    kmers = reads * (READLEN - K + 1) / (static_cast<uint64_t>(TOTAL_PE) * rounds);
+  }
+  return kmers + kmers / 4;
+}
+
+template<int K, int BIGK>
+void kmercounter<K, BIGK>::presize() {
+/*
+ * Reserves the receive arrays of a round at the expected size, so the 
+ * handler grows them in place instead of copying them at every doubling. 
+ * The buckets take the k-mers when there are buckets, and a PE receives 
+ * at most one heavy count per k-mer.
+ */
+  if (!buckets) arena_reserve(*vectordbg, expected);
+  vectordbg->resize(INIT_DBG_SIZE);
+  if (heavydbg) {
+    arena_reserve(*heavydbg, expected);
+    heavydbg->resize(INIT_DBG_SIZE);
+  }
+}
+
+template<int K, int BIGK>
+uint64_t kmercounter<K, BIGK>::count_buckets(uint64_t heavy_size, uint64_t &received, double &sort_time) {
+/*
+ * Appends the counts of the received buckets to countdbg, one merge-join 
+ * with the heavy counts per bucket (see join_buckets), and frees them. 
+ * Returns the heavy hitters joined; received is the number of k-mers in 
+ * the buckets.
+ */
+  const kmer_packet<kmer_type>* heavy = heavydbg ? heavydbg->data() : NULL;
+
+  uint64_t joined = join_buckets(*buckets, heavy, heavy_size, nthreads, 
+    [this](const kmer_type* kmers, uint64_t n, const kmer_packet<kmer_type>* h, uint64_t nh) {
+      return merge_join_counts(kmers, n, h, nh, *countdbg);
+    }, received, sort_time);
+
+  delete buckets;
+  buckets = NULL;
+  return joined;
+}
+
+template<int K, int BIGK>
+void kmercounter<K, BIGK>::count_round(kcount_stats &st) {
+/*
+ * One pass over the input: the k-mers of this round's slice (all of them 
+ * without -R) are sent to their owners, and what a PE receives is counted 
+ * and appended to countdbg, sorted. Later rounds stream the input again 
+ * into new receive structures.
+ */
+  if (round > 0) {
+    reader->rewind();
+    // the workers' staging was sent last round, send_staged must not see it again
+    for (kcount_worker<kmer_type> &w : workers) std::fill(w.first.begin(), w.first.end(), 0);
+    if (node_agg) transit = new transit_buffers<kmer_type>(expected);
+    if (receiver == RECV_HASH) table = new recv_table<kmer_type>(table_bytes, expected_distinct);
+    #if RECV_RADIX_BITS > 0
+    buckets = new recv_buckets<K>(expected);
     #endif
+    presize();
   }
+  if (rounds > 1 && CURR_PE == 0) std::cout << "Counting round " << round + 1 << " of " << rounds << std::endl;
 
-  starttime = MPI_Wtime();
-  kmer_handler* kmer_selector = new kmer_handler(vectordbg, heavydbg);
+  kmer_handler<K, BIGK>* kmer_selector = new kmer_handler<K, BIGK>(vectordbg, heavydbg, canonical, codec, transit, buckets, table, spill, &pe_node);
 
   hclib::finish([=]() {
-    bool done_parsing = false;
     // initialize the variables
-    uint64_t kmers_in_buffer = 0;
-    std::vector<kmer_t> kcount_buffer(KCOUNT_BUCKET_SIZE + (2 * READLEN));
-    std::vector<bigk_packet> big_send_pkt_vec(TOTAL_PE);
+    kcount_worker<kmer_type> &w = workers[0];
+    std::vector<packet_type> big_send_pkt_vec(TOTAL_PE);
     
-    std::vector<bigk_packet> heavy_send_pkt_vec;
-    #if HITTER 
-    heavy_send_pkt_vec.resize(TOTAL_PE);
-    #endif
+    std::vector<packet_type> heavy_send_pkt_vec;
+    if (hitter) heavy_send_pkt_vec.resize(TOTAL_PE);
     
-    uint64_t read_idx = 0;
-    uint64_t iteration = 0;
-
-    init_packets(big_send_pkt_vec, NORMAL);
-
-    #if HITTER
-    init_packets(heavy_send_pkt_vec, HEAVY);
-    #endif
+    init_packets(big_send_pkt_vec, minimizer ? SUPER : (codec ? CODED : NORMAL));
+    if (codec) {
+      frames.resize(TOTAL_PE);
+      for (int i = 0; i < TOTAL_PE; i++) {
+        key_codec::reset(reinterpret_cast<uint8_t*>(big_send_pkt_vec[i].kmers), packet_type::PAYLOAD_BYTES, 
+          frames[i], codec->rice_bits);
+      }
+    }
+    if (hitter) init_packets(heavy_send_pkt_vec, HEAVY);
+    if (node_agg) {
+      transit_pkts.resize(TOTAL_PE);
+      init_packets(transit_pkts, TRANSIT);
+      if (hitter) {
+        transit_heavy_pkts.resize(TOTAL_PE);
+        init_packets(transit_heavy_pkts, TRANSIT_HEAVY);
+      }
+    }
 
     // start the kmer parsing and sending to its owner process
+    // the reads of the next windows arrive while this one is counted
     kmer_selector->start();
-    while (!done_parsing) {
-      read_till_buf_max(read_idx, kcount_buffer, done_parsing, kmers_in_buffer);
-      flush_buffer(kcount_buffer, kmers_in_buffer, kmer_selector, heavy_send_pkt_vec, big_send_pkt_vec);
-      kmers_in_buffer = 0;
+    while (nthreads == 1 && reader->next_window(rchunk, rchunk_len)) {
+      w.read_idx = 0;
+      w.read_end = rchunk_len;
+      w.done_parsing = false;
+
+      while (true) {
+        if (canonical) {
+          read_till_buf_max<true>(w);
+        } else {
+          read_till_buf_max<false>(w);
+        }
+        if (w.done_parsing) break; // the buffer may fill up further from the next window
+
+        flush_buffer(w, kmer_selector, heavy_send_pkt_vec, big_send_pkt_vec);
+        reader->progress();
+      }
     }
-    empty_packets(big_send_pkt_vec, kmer_selector);
+    flush_buffer(w, kmer_selector, heavy_send_pkt_vec, big_send_pkt_vec);
+
+    /*
+     * Threaded mode: the workers parse their ranges of the window (and 
+     * sort and stage their buffers) in rounds, this thread sends what 
+     * they staged between two rounds. It is worker 0 as well.
+     */
+    const int npes = TOTAL_PE;
+    while (nthreads > 1 && reader->next_window(rchunk, rchunk_len)) {
+      split_window();
+      bool done_parsing = false;
+
+      while (!done_parsing) {
+        #pragma omp parallel for num_threads(nthreads) schedule(static, 1)
+        for (int t = 0; t < nthreads; t++) {
+          if (!workers[t].done_parsing) {
+            if (canonical) {
+              read_till_buf_max<true>(workers[t]);
+            } else {
+              read_till_buf_max<false>(workers[t]);
+            }
+          }
+          stage_buffer(workers[t], npes);
+        }
 
-    #if HITTER 
-    empty_packets(heavy_send_pkt_vec, kmer_selector);
-    #endif 
+        send_staged(kmer_selector, heavy_send_pkt_vec, big_send_pkt_vec);
+        done_parsing = std::all_of(workers.begin(), workers.end(), 
+          [](const kcount_worker<kmer_type> &wk) {return wk.done_parsing;});
+        reader->progress();
+      }
+    }
+    if (hitter) send_hot(kmer_selector, heavy_send_pkt_vec);
+    empty_packets(big_send_pkt_vec, kmer_selector);
+    if (hitter) empty_packets(heavy_send_pkt_vec, kmer_selector);
+    if (node_agg) empty_packets(transit_pkts, kmer_selector);
+    if (node_agg && hitter) empty_packets(transit_heavy_pkts, kmer_selector);
 
     kmer_selector->done(PUT);
   });
@@ -317,106 +1065,135 @@ void kmercounter::perform_kcount() {
   char profile_name[] = "kmer_counting";
   kmer_selector->print_profiling(profile_name);
   #endif
+  st.npkts += kmer_selector->npkts;
+  st.remote_pkts += kmer_selector->remote_pkts;
   delete kmer_selector;
 
-  uint32_t low_freq_size = 0;
-  uint32_t vectordbg_size = vectordbg->size();
+  if (node_agg) forward_transit(st.npkts, st.remote_pkts);
 
-  #if HITTER
-  uint32_t high_freq_size = heavydbg->size();
+  #ifdef BENCHMARK
+  /* receiver memory at its peak, the end of the exchange */
+  st.recv_bytes = std::max<uint64_t>(st.recv_bytes, vectordbg->size() * sizeof(kmer_type) + (buckets ? buckets->bytes() : 0) 
+    + (heavydbg ? heavydbg->size() * sizeof(kmer_packet<kmer_type>) : 0) + (table ? table->bytes() : 0));
+  st.table_kmers += table ? table->size : 0;
+  st.table_spilled += table ? table->spilled : 0;
+  #endif
 
-  /* First, sort and merge the duplicates in the high frequency arrays */
-  sort_and_merge_duplicate_kmer_packets(*heavydbg, high_freq_size);
+  /* --mem-limit: once a run is on disk, the k-mers still in memory become 
+     the last one and the final counts are the k-way merge of all runs */
+  const bool spilled = spill && spill->runs() > 0;
+  if (spilled) {
+    spill_received<K>(*vectordbg, vectordbg->size(), heavydbg, heavydbg ? heavydbg->size() : 0, buckets, table, *spill);
+  }
 
-  /* Now, deal with the low frequency kmer array */
-  ska_sort(vectordbg->begin(), vectordbg->begin() + vectordbg_size);
+  /* -r hash: the table's counts join the heavy counts, then the sort backend 
+     takes whatever did not fit in the table */
+  if (table) {
+    table->drain(*heavydbg);
+    delete table;
+    table = NULL;
+  }
 
-  kmer_t curr_kmer = (*vectordbg)[0];
-  count_t curr_count = 1;
-  int idx;
-  int left = 0, right = high_freq_size - 1;
+  const uint64_t counted = countdbg->size(); // by the earlier rounds
+  uint64_t high_freq_size = 0;
 
-  #ifdef BENCHMARK
-  uint32_t binary_search_hit = 0;
-  #endif
+  if (heavydbg) {
+    high_freq_size = heavydbg->size();
 
-  for (uint32_t i = 1; i < vectordbg_size; i++) {
-    kmer_t kmer = (*vectordbg)[i];
-    if (kmer == curr_kmer) {
-      curr_count++;
-    } else {
-      idx = binary_search(*heavydbg, curr_kmer, left, right);
-      
-      if (__builtin_expect(idx != -1, 0)) {
-        (*heavydbg)[idx].count += curr_count;
-        #ifdef BENCHMARK_
-        binary_search_hit++;
-        #endif
-      } else {
-        (*lightdbg)[low_freq_size] = {curr_kmer, curr_count};
-        low_freq_size++;
+    /* First, sort and merge the duplicates in the high frequency arrays */
+    sort_and_merge_duplicate_kmer_packets(*heavydbg, high_freq_size);
+  }
 
-        if (__builtin_expect(low_freq_size == (*lightdbg).size(), 0)) {
-          (*lightdbg).resize(2 * low_freq_size);
-        }
+  /* Now, deal with the low frequency kmer array */
+  double sort_start = MPI_Wtime(), sort_time;
+  uint64_t vectordbg_size, heavy_hits = 0;
+  const kmer_packet<kmer_type>* heavy = heavydbg ? heavydbg->data() : NULL;
 
-      }
-      curr_kmer = kmer;
-      curr_count = 1;
-    }
+  if (buckets) {
+    /* the buckets are sorted and merge-joined one by one */
+    heavy_hits = count_buckets(high_freq_size, vectordbg_size, sort_time);
+  } else {
+    vectordbg_size = vectordbg->size();
+    ska_sort(vectordbg->begin(), vectordbg->end(), [](const kmer_type &a) {return radix_key(a);});
+    sort_time = MPI_Wtime() - sort_start;
+
+    /* Both arrays are sorted, a merge-join counts the low frequency k-mers and 
+      adds the heavy hitter counts into one sorted (*countdbg) array */
+    heavy_hits = merge_join_counts(vectordbg->data(), vectordbg_size, heavy, high_freq_size, *countdbg);
   }
+  if (heavydbg) arena_vector<kmer_packet<kmer_type>>().swap(*heavydbg); // free the memory
 
-  /* deal with the last k-mer */
-  idx = binary_search(*heavydbg, curr_kmer, left, right);
-  if (__builtin_expect(idx != -1, 0)) {
-    (*heavydbg)[idx].count += curr_count;
-    #ifdef BENCHMARK
-    binary_search_hit++;
-    #endif
-  } else {
-    (*lightdbg)[low_freq_size] = {curr_kmer, curr_count};
-    low_freq_size++;
+  #ifdef BENCHMARK
+  st.spilled_runs += spilled ? spill->runs() : 0;
+  #endif
+  if (spilled) {
+    spill->merge([this](const kmer_packet<kmer_type> &pkt) {countdbg->push_back(pkt);});
   }
 
-  /* Now, (*lightdbg) and heavydbg are two sorted arrays that contain all the k-mers 
-    and their counts in the input dataset. For querying, give priority to the heavy- 
-    dbg first, and if a k-mer is not present there, then look for that in (*lightdbg) */
+  #ifdef BENCHMARK
+  st.sort_time += sort_time;
+  st.merge_time += MPI_Wtime() - sort_start - sort_time;
+  st.merge_bytes += 2 * vectordbg_size * sizeof(kmer_type) // run count and join passes
+    + high_freq_size * sizeof(kmer_packet<kmer_type>) + (countdbg->size() - counted) * sizeof(kmer_packet<kmer_type>);
+  st.heavy_size += high_freq_size;
+  st.heavy_hits += heavy_hits;
+  #endif
 
-  #else // HITTER == 0
-  
-  /* Sort and merge the duplicates in the normal kmer array */
-  ska_sort(vectordbg->begin(), vectordbg->begin() + vectordbg_size);
-  kmer_t curr_kmer = (*vectordbg)[0];
-  count_t curr_count = 1;
-
-  for (uint32_t i = 1; i < vectordbg_size; i++) {
-    kmer_t kmer = (*vectordbg)[i];
-    if (kmer == curr_kmer) {
-      curr_count++;
-    } else {
-      (*lightdbg)[low_freq_size] = {curr_kmer, curr_count};
-      low_freq_size++;
+  arena_vector<kmer_type>().swap(*vectordbg); // free the memory
 
-      if (__builtin_expect(low_freq_size == (*lightdbg).size(), 0)) {
-        (*lightdbg).resize(2 * low_freq_size);
-      }
+}
+
+template<int K, int BIGK>
+void kmercounter<K, BIGK>::perform_kcount() {
+/*
+ * the main function of kmercounter class that takes the input vector 
+ * and build the de bruijn graph in terms of a lookup table (implicitly)
+ */ 
+  double starttime, endtime, localtime, globaltime;
+
+  if (CURR_PE == 0) {
+    std::cout << "HITTER flag in " << (hitter ? "ON " : "OFF ") << std::endl;
+    if (minimizer) std::cout << "Minimizer super-k-mers ON (m = " << M << ")" << std::endl;
+    if (codec) std::cout << "Coded packets ON (Rice b = " << codec->rice_bits << ")" << std::endl;
+    if (nthreads > 1) std::cout << "Parsing threads per PE: " << nthreads << std::endl;
+    std::cout << "Base encoding kernel: " << simd_kmers_name() << std::endl;
+    if (node_agg) std::cout << "Node aggregation ON" << std::endl;
+    if (table) std::cout << "Receiver backend: hash table (up to " << (table->max_bytes() >> 20) << " MB)" << std::endl;
+    if (rounds > 1) std::cout << "Counting rounds: " << rounds << " (1/" << rounds << " of the k-mers each)" << std::endl;
+    if (spill) std::cout << "Memory limit: " << (spill->limit >> 20) << " MB of received k-mers per PE" << std::endl;
+    std::cout << "Receive arrays presized to " << expected << " k-mers per PE and round" 
+      << (expected_distinct ? " (estimated)" : "") << std::endl;
+    std::cout << "Canonical k-mers " << (canonical ? "ON" : "OFF") << std::endl;
+  }
 
-      curr_kmer = kmer;
-      curr_count = 1;
+  starttime = MPI_Wtime();
+  pe_node = pe_nodes();
+  if (node_agg) {
+    // remote owners are spread over the PEs of this node
+    std::vector<int> local;
+    for (int p = 0; p < TOTAL_PE; p++) {
+      if (pe_node[p] == pe_node[CURR_PE]) local.push_back(p);
+    }
+    route.resize(TOTAL_PE);
+    for (int p = 0; p < TOTAL_PE; p++) {
+      route[p] = (pe_node[p] == pe_node[CURR_PE]) ? p : local[p % local.size()];
     }
   }
 
-  /* deal with the last k-mer */
-  (*lightdbg)[low_freq_size] = {curr_kmer, curr_count};
-  low_freq_size++;
+  kcount_stats st;
+  for (round = 0; round < rounds; round++) count_round(st);
+  st.spilled_bytes = spill ? spill->bytes() : 0;
 
-  /* Now, just query sorted (*lightdbg) array to get all the k-mers and their counts */
-  #endif
+  /* -R: the rounds appended sorted slices of interleaved k-mers, one in-place 
+     radix sort merges them */
+  if (rounds > 1) {
+    ska_sort(countdbg->begin(), countdbg->end(), [](const kmer_packet<kmer_type> &a) {return radix_key(a.kmer);});
+  }
+  const uint64_t low_freq_size = countdbg->size();
 
+  /* Now, just query sorted (*countdbg) array to get all the k-mers and their counts */
   endtime = MPI_Wtime();
 
-  vectordbg->clear(); // free the memory
-
   localtime = endtime - starttime; 
   MPI_Reduce(&localtime, &globaltime, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
 
@@ -437,35 +1214,74 @@ void kmercounter::perform_kcount() {
     uint64_t global_kmers, global_distinct_kmers;
 
     for (int i = 0; i < low_freq_size; i++) {
-      local_kmers += (*lightdbg)[i].count;
+      local_kmers += (*countdbg)[i].count;
     }
 
-    #if HITTER 
-    local_distinct_kmers += high_freq_size;
-    for (int i = 0; i < high_freq_size; i++) {
-      local_kmers += (*heavydbg)[i].count;
+    /* merge bandwidth: bytes read and written by all PEs over the slowest merge */
+    double global_merge_time;
+    uint64_t global_merge_bytes;
+    MPI_Reduce(&st.merge_time, &global_merge_time, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&st.merge_bytes, &global_merge_bytes, 1, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    double global_sort_time;
+    MPI_Reduce(&st.sort_time, &global_sort_time, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+    /* receiver backend: storage at the end of the exchange, and the peak RSS of the whole run so far */
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    uint64_t peak_rss = static_cast<uint64_t>(usage.ru_maxrss) << 10; // KB on Linux
+    uint64_t global_recv_bytes, global_peak_rss, global_table_kmers, global_table_spilled;
+    MPI_Reduce(&st.recv_bytes, &global_recv_bytes, 1, MPI_UINT64_T, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&peak_rss, &global_peak_rss, 1, MPI_UINT64_T, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&st.table_kmers, &global_table_kmers, 1, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&st.table_spilled, &global_table_spilled, 1, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    uint64_t global_spilled_runs, global_spilled_bytes;
+    MPI_Reduce(&st.spilled_runs, &global_spilled_runs, 1, MPI_UINT64_T, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&st.spilled_bytes, &global_spilled_bytes, 1, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    if (CURR_PE == 0) {
+      std::cout << "receiver backend: " << (receiver == RECV_HASH ? "hash table" : "sort") << std::endl;
+      if (receiver == RECV_HASH) {
+        std::cout << "hash table k-mers: " << global_table_kmers 
+          << ", copies spilled to sorting: " << global_table_spilled << std::endl;
+      }
+      std::cout << "receiver memory: " << global_recv_bytes / 1e6 << " MB (max per PE)" << std::endl;
+      std::cout << "peak RSS: " << global_peak_rss / 1e6 << " MB (max per PE)" << std::endl;
+      if (spill) {
+        std::cout << "spilled runs: " << global_spilled_runs << " (max per PE), " 
+          << global_spilled_bytes / 1e6 << " MB written, merged in the merge-join time" << std::endl;
+      }
     }
 
-    uint64_t lnormal_size, lheavy_size, gnormal_size, gheavy_size;
-    lnormal_size = low_freq_size;
-    lheavy_size = high_freq_size;
+    if (CURR_PE == 0) {
+      std::cout << "received k-mers sort time: " << global_sort_time << " seconds" 
+        << (RECV_RADIX_BITS > 0 ? " (" + std::to_string(1 << RECV_RADIX_BITS) + " buckets)" : "") << std::endl;
+      std::cout << "merge-join time: " << global_merge_time << " seconds" << std::endl;
+      std::cout << "merge-join bandwidth: " << global_merge_bytes / global_merge_time / 1e9 
+        << " GB/s (" << global_merge_bytes / global_merge_time / 1e9 / TOTAL_PE << " GB/s per PE)" << std::endl;
+    }
 
-    MPI_Reduce(&lnormal_size, &gnormal_size, 1, MPI_UINT64_T, MPI_MAX, 0, MPI_COMM_WORLD);
-    MPI_Reduce(&lheavy_size, &gheavy_size, 1, MPI_UINT64_T, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (heavydbg) {
+      uint64_t lnormal_size, lheavy_size, gnormal_size, gheavy_size;
+      lnormal_size = low_freq_size;
+      lheavy_size = st.heavy_size;
 
-    uint64_t total_heavy_size = 0;
-    MPI_Reduce(&lheavy_size, &total_heavy_size, 1, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+      MPI_Reduce(&lnormal_size, &gnormal_size, 1, MPI_UINT64_T, MPI_MAX, 0, MPI_COMM_WORLD);
+      MPI_Reduce(&lheavy_size, &gheavy_size, 1, MPI_UINT64_T, MPI_MAX, 0, MPI_COMM_WORLD);
 
-    uint32_t global_binary_search_hits;
-    MPI_Reduce(&binary_search_hit, &global_binary_search_hits, 1, MPI_UINT32_T, MPI_SUM, 0, MPI_COMM_WORLD);
+      uint64_t total_heavy_size = 0;
+      MPI_Reduce(&lheavy_size, &total_heavy_size, 1, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
 
-    if (CURR_PE == 0) {
-      std::cout << "max normal size: " << gnormal_size << std::endl;
-      std::cout << "max heavy size: " << gheavy_size << std::endl;
-      std::cout << "total heavy size: " << total_heavy_size << std::endl;
-      std::cout << "global binary search hits: " << global_binary_search_hits << std::endl;
+      uint64_t global_heavy_hits;
+      MPI_Reduce(&st.heavy_hits, &global_heavy_hits, 1, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+
+      if (CURR_PE == 0) {
+        std::cout << "max normal size: " << gnormal_size << std::endl;
+        std::cout << "max heavy size: " << gheavy_size << std::endl;
+        std::cout << "total heavy size: " << total_heavy_size << std::endl;
+        std::cout << "global heavy hitters joined: " << global_heavy_hits << std::endl;
+      }
     }
-    #endif
 
     // std::cout << "PE: " << CURR_PE << " Local kmers: " << local_kmers << std::endl;
     // std::cout << "PE: " << CURR_PE << " Local distinct kmers: " << local_distinct_kmers << std::endl;
@@ -503,5 +1319,280 @@ void kmercounter::perform_kcount() {
       std::cout << "dist_std_dev: " << dist_variance << std::endl;
     }
 
+    /* bytes injected into the network, every packet is sent whole */
+    uint64_t global_npkts;
+    MPI_Reduce(&st.npkts, &global_npkts, 1, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (CURR_PE == 0) {
+      std::cout << "packets sent: " << global_npkts << " (" << global_npkts * sizeof(packet_type) 
+        << " bytes, " << (global_npkts ? (double)global_kmers / global_npkts : 0.0) << " k-mers per packet)" << std::endl;
+    }
+
+    /* the inter-node share of them, the volume the model charges at blink */
+    uint64_t global_remote_pkts, global_forwarded;
+    MPI_Reduce(&st.remote_pkts, &global_remote_pkts, 1, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&forwarded, &global_forwarded, 1, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (CURR_PE == 0) {
+      std::cout << "inter-node packets: " << global_remote_pkts << " (" << global_remote_pkts * sizeof(packet_type) 
+        << " bytes)" << std::endl;
+      if (node_agg) std::cout << "k-mer copies combined inside their node: " << global_forwarded << std::endl;
+    }
+
+    #if HITTER_SKETCH
+    if (hitter) {
+      uint64_t global_absorbed;
+      MPI_Reduce(&hot->absorbed, &global_absorbed, 1, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+      if (CURR_PE == 0) {
+        std::cout << "copies counted as hot k-mers: " << global_absorbed << " (" 
+          << 100.0 * global_absorbed / global_kmers << "% of global_kmers)" << std::endl;
+      }
+    }
+    #endif
+
   #endif
 }
+
+static uint64_t solid_threshold(const std::vector<uint64_t> &hist) {
+/*
+ * Minimum count of a solid k-mer, read off the k-mer spectrum like 
+ * PakMan*'s min_bucket: the least populated count, but only among the 
+ * counts below the solid (coverage) peak, so a spectrum that keeps 
+ * falling past the error k-mers can't push the cut into the tail. 
+ * Returns 1 (keep all) if the spectrum never rises again.
+ */
+  const uint64_t last = hist.size() - 1; // hist[last] collects the larger counts
+  uint64_t c = 1;
+  while (c + 1 < last && hist[c + 1] <= hist[c]) c++;
+  if (c + 1 >= last) return 1;
+
+  uint64_t peak = std::max_element(hist.begin() + c, hist.begin() + last) - hist.begin();
+  return std::min_element(hist.begin() + 1, hist.begin() + peak + 1) - hist.begin();
+}
+
+template<int K, int BIGK>
+void kmercounter<K, BIGK>::filter_kmers() {
+/*
+ * Builds the k-mer spectrum (number of distinct k-mers per count) from the 
+ * final table, sums it over all PEs and drops the k-mers whose count lies 
+ * outside [min_count, max_count]; with solid, min_count comes from the 
+ * error/solid valley of the spectrum.
+ */
+  double starttime, endtime, localtime, globaltime;
+  std::vector<uint64_t> local_hist(HIST_BUCKETS + 1, 0), hist(HIST_BUCKETS + 1, 0);
+
+  starttime = MPI_Wtime();
+  for (const auto &pkt : *countdbg) local_hist[std::min<count_t>(pkt.count, HIST_BUCKETS)]++;
+  MPI_Allreduce(local_hist.data(), hist.data(), HIST_BUCKETS + 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+
+  if (solid) min_count = solid_threshold(hist);
+
+  uint64_t local_kept[2], kept[2];
+  local_kept[0] = countdbg->size();
+  auto weak = [this](const kmer_packet<kmer_type> &pkt) {
+    return pkt.count < min_count || pkt.count > max_count;
+  };
+  countdbg->erase(std::remove_if(countdbg->begin(), countdbg->end(), weak), countdbg->end());
+  local_kept[1] = countdbg->size();
+  endtime = MPI_Wtime();
+
+  localtime = endtime - starttime;
+  MPI_Reduce(&localtime, &globaltime, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+  MPI_Reduce(local_kept, kept, 2, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+
+  if (CURR_PE == 0) {
+    if (!hist_file.empty()) {
+      std::ofstream out(hist_file);
+      for (int c = 1; c < HIST_BUCKETS; c++) {
+        if (hist[c] > 0) out << c << "\t" << hist[c] << "\n";
+      }
+      if (hist[HIST_BUCKETS] > 0) out << ">=" << HIST_BUCKETS << "\t" << hist[HIST_BUCKETS] << "\n";
+      if (!out) std::cout << "Couldn't write the k-mer spectrum to " << hist_file << std::endl;
+    }
+
+    if (solid) std::cout << "solid k-mer threshold (spectrum valley): " << min_count << std::endl;
+    std::cout << "k-mers kept in [" << min_count << ", " << max_count << "]: " << kept[1] << " of " 
+      << kept[0] << " distinct (" << (kept[0] ? 100.0 * kept[1] / kept[0] : 100.0) << "%)" << std::endl;
+    std::cout << "k-mer filtering time: " << globaltime << " seconds" << std::endl;
+  }
+}
+
+template<int K, int BIGK>
+void kmercounter<K, BIGK>::write_table() {
+/*
+ * Writes the final counts to output_file (see ktable.hpp), one sorted 
+ * section per PE.
+ */
+  double starttime, endtime, localtime, globaltime;
+  uint64_t w[kmer_traits<K>::WORDS];
+
+  starttime = MPI_Wtime();
+  ktable_writer table(K, kmer_traits<K>::WORDS, canonical, OWNER_SEED, minimizer ? M : 0);
+
+  for (const auto &pkt : *countdbg) {
+    key_words(pkt.kmer, w);
+    table.add(w, pkt.count);
+  }
+
+  uint64_t bytes = table.write(output_file);
+  endtime = MPI_Wtime();
+
+  localtime = endtime - starttime;
+  MPI_Reduce(&localtime, &globaltime, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+  if (CURR_PE == 0) {
+    std::cout << "k-mer table: " << output_file << " (" << bytes << " bytes), writing time: " 
+      << globaltime << " seconds" << std::endl;
+  }
+}
+
+template<int K, int BIGK>
+void kmercounter<K, BIGK>::serve_queries() {
+/*
+ * Answers batches of k-mer queries from the final tables (see 
+ * query_batch.hpp). Every query is routed to its owner PE (the owner of 
+ * its minimizer in minimizer mode), which looks it up through the Eytzinger index built once here, so the tables 
+ * stay resident for as many batches as the query argument names.
+ */
+  double starttime, endtime, localtime, globaltime;
+  typedef query_packet<kmer_type, BIGK> qpacket_type;
+
+  starttime = MPI_Wtime();
+  count_table<kmer_type> table;
+  table.build(countdbg);
+  endtime = MPI_Wtime();
+
+  localtime = endtime - starttime;
+  MPI_Reduce(&localtime, &globaltime, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+  if (CURR_PE == 0) {
+    std::cout << "query index building time: " << globaltime << " seconds" << std::endl;
+  }
+
+  std::vector<kmer_type> queries;
+  std::vector<uint32_t> query_ids;
+  std::vector<int> query_owners;
+  std::vector<count_t> counts;
+  std::vector<uint8_t> bases(K);
+  std::string filename;
+  uint64_t nbatches = 0;
+
+  while (next_query_file(query_file, nbatches, filename)) {
+    query_batch batch(filename, QUERY_ROUND_SIZE);
+    if (!batch.open()) continue;
+
+    uint64_t served = 0, found = 0;
+    const char* data;
+    uint64_t len;
+
+    starttime = MPI_Wtime();
+    while (batch.next_round(data, len)) {
+      queries.clear();
+      query_ids.clear();
+      query_owners.clear();
+      counts.clear();
+
+      /* one query per line, lines that are not a k-mer are answered with 0 */
+      uint64_t line = 0;
+      while (line < len) {
+        const char* nl = static_cast<const char*>(memchr(data + line, '\n', len - line));
+        uint64_t line_end = nl ? nl - data : len;
+        uint64_t line_len = line_end - line;
+        if (line_len > 0 && data[line_end - 1] == '\r') line_len--;
+
+        bool valid = (line_len == K);
+        for (int i = 0; valid && i < K; i++) {
+          bases[i] = char2base(data[line + i]);
+          valid = (bases[i] <= 0x3);
+        }
+        if (valid) {
+          kmer_type kmer = set_kmer_fast(bases.data());
+          if (canonical) kmer = canonical_kmer(kmer, set_rc_fast(bases.data()));
+          queries.push_back(kmer);
+          query_ids.push_back(counts.size());
+          query_owners.push_back(minimizer ? minimizer_hash(bases.data(), K, canonical) % TOTAL_PE : owner_pe(kmer));
+        }
+        counts.push_back(0);
+        line = line_end + 1;
+      }
+
+      query_handler<K, BIGK>* query_selector = new query_handler<K, BIGK>(&table, &counts);
+      hclib::finish([=, &queries, &query_ids, &query_owners]() {
+        std::vector<qpacket_type> send_pkt_vec(TOTAL_PE);
+        for (int i = 0; i < TOTAL_PE; i++) send_pkt_vec[i].size = 0;
+
+        query_selector->start();
+        for (size_t i = 0; i < queries.size(); i++) {
+          int owner = query_owners[i];
+          qpacket_type &pkt = send_pkt_vec[owner];
+
+          pkt.kmers[pkt.size] = queries[i];
+          pkt.ids[pkt.size] = query_ids[i];
+          pkt.size++;
+
+          if (pkt.size == qpacket_type::CAP) {
+            query_selector->send(QUERY, pkt, owner);
+            pkt.size = 0;
+          }
+        }
+        for (int i = 0; i < TOTAL_PE; i++) {
+          if (send_pkt_vec[i].size > 0) query_selector->send(QUERY, send_pkt_vec[i], i);
+        }
+        query_selector->done(QUERY);
+      });
+
+      served += query_selector->served;
+      found += query_selector->found;
+      delete query_selector;
+
+      batch.write_counts(counts);
+    }
+    endtime = MPI_Wtime();
+    batch.close();
+
+    uint64_t local[3] = {batch.numqueries, found, served}, global[3], max_served;
+    MPI_Reduce(local, global, 3, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&served, &max_served, 1, MPI_UINT64_T, MPI_MAX, 0, MPI_COMM_WORLD);
+    localtime = endtime - starttime;
+    MPI_Reduce(&localtime, &globaltime, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+    if (CURR_PE == 0) {
+      std::cout << "query batch " << filename << ": " << global[0] << " queries, " << global[1] 
+        << " found, answers in " << batch.out_filename << std::endl;
+      std::cout << "query time: " << globaltime << " seconds" << std::endl;
+      #ifdef BENCHMARK
+      std::cout << "query lookups per second: " << global[2] / globaltime << std::endl;
+      std::cout << "max lookups served by a PE: " << max_served << std::endl;
+      #endif
+    }
+  }
+}
+
+// Specialization dispatch -----------------------------------------------------
+bool count_kmers(fqreader &reader, const kcount_config &cfg) {
+  #define DAKC_RUN_SPECIALIZATION(K_, BIGK_) \
+    if (cfg.kmer_len == K_ && cfg.pkt_size == BIGK_) { \
+      arena_vector<typename kmer_traits<K_>::type> vectordbg; \
+      kmercounter<K_, BIGK_> km(reader, vectordbg, cfg); \
+      return true; \
+    }
+
+  DAKC_FOR_EACH_SPECIALIZATION(DAKC_RUN_SPECIALIZATION)
+  #undef DAKC_RUN_SPECIALIZATION
+
+  if (CURR_PE == 0) {
+    std::cout << "k = " << cfg.kmer_len << ", C2 = " << 2 * cfg.pkt_size 
+      << " is not compiled into this binary (see DAKC_FOR_EACH_SPECIALIZATION)" << std::endl;
+  }
+  return false;
+}
+
+std::vector<int> compiled_pkt_sizes(int kmer_len) {
+  std::vector<int> sizes;
+  #define DAKC_PKT_SIZE(K_, BIGK_) \
+    if (kmer_len == K_) sizes.push_back(BIGK_);
+
+  DAKC_FOR_EACH_SPECIALIZATION(DAKC_PKT_SIZE)
+  #undef DAKC_PKT_SIZE
+
+  std::sort(sizes.begin(), sizes.end());
+  sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+  return sizes;
+}
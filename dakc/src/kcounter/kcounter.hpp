@@ -7,8 +7,17 @@
 #include <unordered_map>
 #include <bitset>
 #include <map>
+#include <tuple>
+#include <utility>
+#include <algorithm>
 
 #include "common.hpp"
+#include "fqreader.hpp"
+#include "eytzinger.hpp"
+#include "kmer_codec.hpp"
+#include "simd_kmers.hpp"
+#include "spill_runs.hpp"
+#include "arena.hpp"
 
 #define EVEN_MASK 0xAAAAAAAAAAAAAAAAULL // 101010....101010
 #define ODD_MASK  0x5555555555555555ULL // 010101....010101
@@ -16,9 +25,44 @@
 #define HITTERMAX 10
 #define INIT_DBG_SIZE 1000000
 
+/* heavy hitters learned across flushes, see hot_kmers (hitter runs only) */
+#ifndef HITTER_SKETCH
+#define HITTER_SKETCH 1
+#endif
+
+#ifndef SKETCH_DEPTH
+#define SKETCH_DEPTH 2
+#endif
+
+#ifndef SKETCH_WIDTH
+#define SKETCH_WIDTH (1 << 16) /* counters per row, a power of two */
+#endif
+
+#ifndef HOT_THRESHOLD
+#define HOT_THRESHOLD 16 /* estimated copies that make a k-mer hot */
+#endif
+
+#ifndef HOT_TABLE_SIZE
+#define HOT_TABLE_SIZE (1 << 14) /* hot k-mers accumulated at once */
+#endif
+
+#ifndef HOT_FLUSH_INTERVAL
+#define HOT_FLUSH_INTERVAL 16 /* buffer flushes between two sends of the hot counts */
+#endif
+
+#ifndef RECV_TABLE_MIN_SLOTS
+#define RECV_TABLE_MIN_SLOTS (1 << 16) /* initial slots of the -r hash receiver table, a power of two */
+#endif
+
+#ifndef RECV_TABLE_MAX_BYTES
+#define RECV_TABLE_MAX_BYTES (1ULL << 30) /* the -r hash table stops growing here, new k-mers are sorted instead */
+#endif
+
 enum MailBoxType {PUT};
 
-enum kmer_pkt_type{NORMAL, HEAVY};
+enum kmer_pkt_type{NORMAL, HEAVY, SUPER, CODED, TRANSIT, TRANSIT_HEAVY};
+
+enum QueryMailBoxType {QUERY, REPLY};
 
 /* 
  * Since majority of the k-mers are not heavy hitters, we can send them 
@@ -30,26 +74,402 @@ enum kmer_pkt_type{NORMAL, HEAVY};
  * 
  * Most of the time, the packet type will be NORMAL, so we can save a lot 
  * of space (hopefully)
+ * 
+ * when bigk_packet.type == SUPER (minimizer mode), the k-mer area holds 
+ * super-k-mers back to back, each a length byte (in bases) followed by 
+ * its bases packed 4 per byte, first base in the high bits, and size 
+ * counts bytes
+ * 
+ * when bigk_packet.type == CODED (codec mode, 64-bit k-mers), the k-mer 
+ * area is a key_codec frame of size (key, count) entries
+ * 
+ * TRANSIT and TRANSIT_HEAVY packets (node aggregation) are laid out like 
+ * NORMAL and HEAVY ones but hold k-mers owned on another node, which the 
+ * receiver combines and forwards to their owners
  */
 
-typedef struct kmer_packet_type {
-  kmer_t kmer;
+template<typename kmer_type>
+struct kmer_packet {
+  kmer_type kmer;
   count_t count;
-} kmer_packet;
+};
+
+/* 
+ * The payload always holds 2 x BIGK k-mers, so the bytes on the wire only 
+ * grow with the key width. A heavy packet stores HEAVY_CAP k-mers followed 
+ * by their 64-bit counts in the same bytes (BIGK of each for 64-bit k-mers).
+ */
+template<typename kmer_type, int BIGK>
+struct bigk_packet {
+  static constexpr int NORMAL_CAP = 2 * BIGK;
+  static constexpr int HEAVY_CAP = (NORMAL_CAP * sizeof(kmer_type)) / (sizeof(kmer_type) + sizeof(count_t));
+  static constexpr int PAYLOAD_BYTES = NORMAL_CAP * sizeof(kmer_type);
 
-typedef struct bigk_packet_type {
-  kmer_t kmers[2 * BIGKSIZE]; // second half works as 64-bit counts for heavy packets
-  int size; // size is BIGKSIZE * 2 for normal, BIGKSIZE for heavy hitters
+  kmer_type kmers[NORMAL_CAP]; // tail works as 64-bit counts for heavy packets
+  int size; // size is NORMAL_CAP for normal, HEAVY_CAP for heavy hitters
   int type;
   // uint64_t buffer; // Just to make the total packet a multiple of 64 bits !!!
-} bigk_packet;
 
-class kmer_handler: public hclib::Selector<1, bigk_packet> {
+  inline count_t get_count(int i) const {
+    count_t count;
+    memcpy(&count, reinterpret_cast<const char*>(&kmers[HEAVY_CAP]) + i * sizeof(count_t), sizeof(count_t));
+    return count;
+  }
+
+  inline void set_count(int i, count_t count) {
+    memcpy(reinterpret_cast<char*>(&kmers[HEAVY_CAP]) + i * sizeof(count_t), &count, sizeof(count_t));
+  }
+};
+
+/* 
+ * A query packet carries up to 2 x BIGK k-mers to their owner PE, and 
+ * returns to the sender with their counts written over the k-mers 
+ * (sizeof(kmer_type) >= sizeof(count_t)). ids are the positions of the 
+ * k-mers in the sender's round of queries.
+ */
+template<typename kmer_type, int BIGK>
+struct query_packet {
+  static constexpr int CAP = 2 * BIGK;
+
+  kmer_type kmers[CAP];
+  uint32_t ids[CAP];
+  int size;
+
+  inline count_t get_count(int i) const {
+    count_t count;
+    memcpy(&count, reinterpret_cast<const char*>(kmers) + i * sizeof(count_t), sizeof(count_t));
+    return count;
+  }
+
+  /* never overwrites kmers[j] for j > i, so a packet is answered in place */
+  inline void set_count(int i, count_t count) {
+    memcpy(reinterpret_cast<char*>(kmers) + i * sizeof(count_t), &count, sizeof(count_t));
+  }
+};
+
+/* 
+ * Heavy hitters learned across flushes. flush_buffer only sees the repeats 
+ * inside one buffer, so k-mers that are frequent overall but spread thin 
+ * (repeats, adapters) would still travel one copy at a time. A Count-Min 
+ * sketch with conservative update estimates how often every k-mer was 
+ * sent lately; once the estimate reaches HOT_THRESHOLD the k-mer is 
+ * counted in a small local table instead. drain() hands the table over 
+ * as (k-mer, count) pairs for HEAVY packets and halves the sketch, so it 
+ * follows the recent part of the stream.
+ */
+template<typename kmer_type>
+class hot_kmers {
+public:
+  static_assert((SKETCH_WIDTH & (SKETCH_WIDTH - 1)) == 0, "SKETCH_WIDTH must be a power of two");
+  static constexpr size_t SLOTS = 2 * HOT_TABLE_SIZE; // load factor <= 1/2
+
+  uint64_t absorbed = 0; // copies counted in the table instead of sent
+
+  hot_kmers() : sketch(SKETCH_DEPTH * SKETCH_WIDTH, 0), keys(SLOTS), counts(SLOTS, 0), used(SLOTS, 0) {}
+
+  /* true if the table took the copies, hash is any 64-bit hash of kmer */
+  inline bool add(const kmer_type &kmer, uint64_t hash, count_t count) {
+    size_t slot = (hash >> 32) & (SLOTS - 1);
+    while (used[slot]) {
+      if (keys[slot] == kmer) {
+        counts[slot] += count;
+        absorbed += count;
+        return true;
+      }
+      slot = (slot + 1) & (SLOTS - 1);
+    }
+
+    if (estimate_add(hash, count) < HOT_THRESHOLD || size == HOT_TABLE_SIZE) return false;
+
+    used[slot] = 1;
+    keys[slot] = kmer;
+    counts[slot] = count;
+    absorbed += count;
+    size++;
+    return true;
+  }
+
+  template<typename send_fn>
+  void drain(send_fn send) {
+    for (size_t slot = 0; slot < SLOTS && size > 0; slot++) {
+      if (!used[slot]) continue;
+      send(keys[slot], counts[slot]);
+      used[slot] = 0;
+      size--;
+    }
+    for (auto &c : sketch) c >>= 1;
+  }
+
+private:
+  std::vector<uint32_t> sketch; // SKETCH_DEPTH rows of SKETCH_WIDTH counters
+  std::vector<kmer_type> keys;
+  std::vector<count_t> counts;
+  std::vector<uint8_t> used;
+  size_t size = 0;
+
+  /* conservative update: only the counters below the new estimate grow */
+  inline uint32_t estimate_add(uint64_t hash, count_t count) {
+    const uint64_t h2 = (hash >> 32) | 1;
+    size_t idx[SKETCH_DEPTH];
+    uint64_t est = UINT32_MAX;
+
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+      idx[i] = i * SKETCH_WIDTH + ((hash + i * h2) & (SKETCH_WIDTH - 1));
+      est = std::min<uint64_t>(est, sketch[idx[i]]);
+    }
+    est = std::min<uint64_t>(est + count, UINT32_MAX);
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+      if (sketch[idx[i]] < est) sketch[idx[i]] = est;
+    }
+    return est;
+  }
+};
+
+/* radix sort keys handed to ska_sort, most significant part first */
+inline uint64_t radix_key(uint64_t kmer) { return kmer; }
+
+inline std::pair<uint64_t, uint64_t> radix_key(__uint128_t kmer) {
+  return {static_cast<uint64_t>(kmer >> 64), static_cast<uint64_t>(kmer)};
+}
+
+template<int W, size_t... I>
+inline auto radix_key_words(const kmer_words<W> &kmer, std::index_sequence<I...>) {
+  return std::make_tuple(kmer.w[I]...);
+}
+
+template<int W>
+inline auto radix_key(const kmer_words<W> &kmer) {
+  return radix_key_words(kmer, std::make_index_sequence<W>());
+}
+
+/* 64-bit words of a k-mer, most significant first (k-mer table keys) */
+inline void key_words(uint64_t kmer, uint64_t* w) { w[0] = kmer; }
+
+inline void key_words(__uint128_t kmer, uint64_t* w) {
+  w[0] = static_cast<uint64_t>(kmer >> 64);
+  w[1] = static_cast<uint64_t>(kmer);
+}
+
+template<int W>
+inline void key_words(const kmer_words<W> &kmer, uint64_t* w) {
+  for (int i = 0; i < W; i++) w[i] = kmer.w[i];
+}
+
+/* lowest 64 bits of a k-mer */
+inline uint64_t low_word(uint64_t kmer) { return kmer; }
+inline uint64_t low_word(__uint128_t kmer) { return static_cast<uint64_t>(kmer); }
+
+template<int W>
+inline uint64_t low_word(const kmer_words<W> &kmer) { return kmer.w[W - 1]; }
+
+/* seed of the hash that picks the owner PE of a k-mer (or of its minimizer) */
+#define OWNER_SEED 0x9E3779B97F4A7C15ULL
+
+/* seed of the hash placing a k-mer in the receiver table of -r hash */
+#define TABLE_SEED 0xD6E8FEB86659FD93ULL
+
+uint64_t MurmurHash64A(uint64_t key, uint64_t seed);
+uint64_t MurmurHash64A_inverse(uint64_t hash, uint64_t seed);
+
+/* wider k-mers chain the 64-bit hash over their words */
+inline uint64_t kmer_hash(uint64_t kmer, uint64_t seed) {
+  return MurmurHash64A(kmer, seed);
+}
+
+inline uint64_t kmer_hash(__uint128_t kmer, uint64_t seed) {
+  return MurmurHash64A(static_cast<uint64_t>(kmer), MurmurHash64A(static_cast<uint64_t>(kmer >> 64), seed));
+}
+
+template<int W>
+inline uint64_t kmer_hash(const kmer_words<W> &kmer, uint64_t seed) {
+  uint64_t h = seed;
+  for (int i = 0; i < W; i++) h = MurmurHash64A(kmer.w[i], h);
+  return h;
+}
+
+/*
+ * Receiver backend of -r hash: counts the received k-mers on arrival in 
+ * an open addressing table, so the memory of a PE follows its distinct 
+ * k-mers rather than every copy it receives. A slot holds a k-mer and 
+ * its count side by side (count 0 marks a free slot), so a probe reads 
+ * one cache line and linear probing stays in it or the next one. The 
+ * table doubles at 3/4 load up to max_bytes (RECV_TABLE_MAX_BYTES, less 
+ * with --mem-limit); once full, add() refuses new k-mers, which fall back 
+ * to sorting, while the k-mers already in the table keep counting there.
+ */
+template<typename kmer_type>
+class recv_table {
+public:
+  uint64_t size = 0; // distinct k-mers in the table
+  uint64_t spilled = 0; // copies of new k-mers refused once full
+
+  /* expected: distinct k-mers it will hold if known (-e), the table starts at that size */
+  recv_table(uint64_t max_bytes, uint64_t expected = 0) : max_slots(RECV_TABLE_MIN_SLOTS) {
+    while (4 * expected > 3 * max_slots && 2 * max_slots * sizeof(kmer_packet<kmer_type>) <= max_bytes) max_slots *= 2;
+    while (max_slots > 16 && max_slots * sizeof(kmer_packet<kmer_type>) > max_bytes) max_slots /= 2;
+    slots.assign(max_slots, kmer_packet<kmer_type>{kmer_type(0), 0});
+    while (2 * max_slots * sizeof(kmer_packet<kmer_type>) <= max_bytes) max_slots *= 2;
+  }
+
+  /* hash is kmer_hash(kmer, TABLE_SEED) */
+  inline void prefetch(uint64_t hash) const { __builtin_prefetch(&slots[hash & (slots.size() - 1)]); }
+
+  /* false if kmer is new and the table is full */
+  inline bool add(const kmer_type &kmer, uint64_t hash, count_t count) {
+    while (true) {
+      const uint64_t mask = slots.size() - 1;
+      uint64_t slot = hash & mask;
+      for (; slots[slot].count != 0; slot = (slot + 1) & mask) {
+        if (slots[slot].kmer == kmer) {
+          slots[slot].count += count;
+          return true;
+        }
+      }
+      if (4 * (size + 1) <= 3 * slots.size()) {
+        slots[slot] = {kmer, count};
+        size++;
+        return true;
+      }
+      if (slots.size() == max_slots) {
+        spilled += count;
+        return false;
+      }
+      grow();
+    }
+  }
+
+  uint64_t bytes() const { return slots.capacity() * sizeof(kmer_packet<kmer_type>); }
+  uint64_t max_bytes() const { return max_slots * sizeof(kmer_packet<kmer_type>); }
+
+  /* moves the size entries to the front of the slots, in no order, to be sorted in place; add() waits for clear() */
+  kmer_packet<kmer_type>* compact() {
+    uint64_t n = 0;
+    for (const kmer_packet<kmer_type> &s : slots) {
+      if (s.count != 0) slots[n++] = s;
+    }
+    return slots.data();
+  }
+
+  /* empties the table and keeps its slots */
+  void clear() {
+    std::fill(slots.begin(), slots.end(), kmer_packet<kmer_type>{kmer_type(0), 0});
+    size = 0;
+  }
+
+  /* appends the (k-mer, count) entries to out and frees the table */
+  void drain(arena_vector<kmer_packet<kmer_type>> &out) {
+    out.reserve(out.size() + size);
+    for (const kmer_packet<kmer_type> &s : slots) {
+      if (s.count != 0) out.push_back(s);
+    }
+    std::vector<kmer_packet<kmer_type>>().swap(slots);
+    size = 0;
+  }
+
+private:
+  std::vector<kmer_packet<kmer_type>> slots;
+  uint64_t max_slots;
+
+  void grow() {
+    std::vector<kmer_packet<kmer_type>> old(2 * slots.size(), kmer_packet<kmer_type>{kmer_type(0), 0});
+    old.swap(slots);
+    const uint64_t mask = slots.size() - 1;
+    for (const kmer_packet<kmer_type> &s : old) {
+      if (s.count == 0) continue;
+      uint64_t slot = kmer_hash(s.kmer, TABLE_SEED) & mask;
+      while (slots[slot].count != 0) slot = (slot + 1) & mask;
+      slots[slot] = s;
+    }
+  }
+};
+
+/* 
+ * (k, BIGKSIZE) pairs compiled into the binary. Every pair is a separate 
+ * specialization of kmer_handler and kmercounter, so KMER_MASK and the 
+ * packet layout stay compile time constants inside the hot loops. The 
+ * -k and -c flags pick one of them at run time. Either list can be replaced 
+ * from COMPILETIMEVARS to build a smaller binary.
+ */
+#ifndef DAKC_FOR_EACH_KMERLEN
+#define DAKC_FOR_EACH_KMERLEN(F, BIGK) \
+  F(11, BIGK) F(13, BIGK) F(15, BIGK) F(17, BIGK) F(19, BIGK) F(21, BIGK) \
+  F(23, BIGK) F(25, BIGK) F(27, BIGK) F(29, BIGK) F(31, BIGK) F(32, BIGK) \
+  F(41, BIGK) F(47, BIGK) F(51, BIGK) F(55, BIGK) F(61, BIGK) F(63, BIGK) \
+  F(64, BIGK) F(71, BIGK) F(81, BIGK) F(91, BIGK) F(95, BIGK) F(101, BIGK) \
+  F(111, BIGK) F(121, BIGK) F(127, BIGK)
+#endif
+
+#ifndef DAKC_FOR_EACH_SPECIALIZATION
+#define DAKC_FOR_EACH_SPECIALIZATION(F) \
+  DAKC_FOR_EACH_KMERLEN(F, 8) DAKC_FOR_EACH_KMERLEN(F, 16) DAKC_FOR_EACH_KMERLEN(F, 32)
+#endif
+
+/* node aggregation: k-mers a PE received to forward to another node */
+template<typename kmer_type>
+struct transit_buffers {
+  arena_vector<kmer_type> kmers;
+  arena_vector<kmer_packet<kmer_type>> runs;
+  uint64_t nkmers = 0;
+  uint64_t nruns = 0;
+
+  transit_buffers(uint64_t expected) { arena_reserve(kmers, expected); }
+};
+
+/*
+ * Received k-mers scattered by their top RECV_RADIX_BITS bits as the 
+ * packets arrive. Bucket b holds a range of keys below those of bucket 
+ * b + 1, so the buckets can be sorted and counted one by one, each small 
+ * enough to stay in cache, instead of one out-of-cache sort over all the 
+ * k-mers of a PE.
+ */
+template<int K>
+struct recv_buckets {
+  typedef typename kmer_traits<K>::type kmer_type;
+  static constexpr int SHIFT = (RECV_RADIX_BITS > 0) ? 2 * K - RECV_RADIX_BITS : 0; // 0 bits: never allocated
+  static_assert(SHIFT >= 0, "bucket bits do not fit in a k-mer");
+
+  std::vector<arena_vector<kmer_type>> bucket;
+
+  /* reserves four times a bucket's share of expected k-mers, the prefixes are not uniform */
+  recv_buckets(uint64_t expected) : bucket(1 << RECV_RADIX_BITS) {
+    for (arena_vector<kmer_type> &b : bucket) arena_reserve(b, 4 * (expected >> RECV_RADIX_BITS));
+  }
+
+  static inline uint64_t prefix(const kmer_type &kmer) { return low_word(kmer >> SHIFT); }
+
+  inline void add(const kmer_type &kmer) {
+    bucket[prefix(kmer)].push_back(kmer);
+    held++;
+  }
+
+  /* empties bucket b and returns its memory */
+  void release(int b) {
+    held -= bucket[b].size();
+    arena_release(bucket[b]);
+  }
+
+  uint64_t bytes() const { return held * sizeof(kmer_type); }
+
+private:
+  uint64_t held = 0; // k-mers in the buckets, only the written part of an arena holds memory
+};
+
+template<int K, int BIGK>
+class kmer_handler: public hclib::Selector<1, bigk_packet<typename kmer_traits<K>::type, BIGK>> {
 public: 
-  kmer_handler(std::vector<kmer_t> *dbg, std::vector<kmer_packet> *heavydbg) 
-    : dbg_(dbg), dbg_size(0), heavydbg_(heavydbg), heavydbg_size(0) {
+  typedef typename kmer_traits<K>::type kmer_type;
+  typedef bigk_packet<kmer_type, BIGK> packet_type;
 
-    mb[PUT].process = [this] (bigk_packet pkt, int sender_pe) {
+  uint64_t npkts = 0; // packets received
+  uint64_t remote_pkts = 0; // packets received from another node
+
+  kmer_handler(arena_vector<kmer_type> *dbg, arena_vector<kmer_packet<kmer_type>> *heavydbg, bool canonical, 
+    const key_codec *codec, transit_buffers<kmer_type> *transit, recv_buckets<K> *buckets, 
+    recv_table<kmer_type> *table, spill_runs<kmer_packet<kmer_type>> *spill, const std::vector<int> *pe_node) 
+    : dbg_(dbg), dbg_size(0), heavydbg_(heavydbg), heavydbg_size(0), canonical_(canonical), codec_(codec), 
+      transit_(transit), buckets_(buckets), table_(table), spill_(spill), pe_node_(pe_node), my_node_((*pe_node)[CURR_PE]) {
+
+    this->mb[PUT].process = [this] (packet_type pkt, int sender_pe) {
       this->recv_kmer(pkt, sender_pe);
     };
   }
@@ -57,59 +477,373 @@ public:
   ~kmer_handler() {
     // Destructor code here
     dbg_->resize(dbg_size);
-    #if HITTER
-    heavydbg_->resize(heavydbg_size);
-    #endif
+    if (heavydbg_) heavydbg_->resize(heavydbg_size);
+  }
+
+  /* append to the k-mers received by an earlier selector */
+  void resume() {
+    dbg_size = dbg_->size();
+    heavydbg_size = heavydbg_ ? heavydbg_->size() : 0;
+  }
+
+private: 
+  arena_vector<kmer_type> *dbg_;
+  arena_vector<kmer_packet<kmer_type>> *heavydbg_;
+  uint64_t dbg_size, heavydbg_size;
+  bool canonical_;
+  const key_codec *codec_;
+  transit_buffers<kmer_type> *transit_;
+  recv_buckets<K> *buckets_;
+  recv_table<kmer_type> *table_;
+  spill_runs<kmer_packet<kmer_type>> *spill_;
+  const std::vector<int> *pe_node_;
+  int my_node_;
+  void recv_kmer(packet_type pkt, int sender_pe);
+  void recv_superkmers(const packet_type &pkt);
+  void recv_coded(const packet_type &pkt);
+  void recv_transit(const packet_type &pkt);
+  void tally(const kmer_type* kmers, const count_t* counts, int n);
+  void store(const kmer_type &kmer, count_t count);
+  template<typename T>
+  void make_room(arena_vector<T> &v, uint64_t &used, uint64_t n);
+  void spill();
+
+  /* memory of the received k-mers, what --mem-limit bounds (the sized part of the arrays' arenas) */
+  uint64_t recv_bytes() const {
+    return dbg_->size() * sizeof(kmer_type) + (buckets_ ? buckets_->bytes() : 0) + (table_ ? table_->bytes() : 0) 
+      + (heavydbg_ ? heavydbg_->size() * sizeof(kmer_packet<kmer_type>) : 0);
+  }
+};
+
+/* final sorted counts of a PE with an Eytzinger index over them */
+template<typename kmer_type>
+struct count_table {
+  const arena_vector<kmer_packet<kmer_type>> *counts = NULL;
+  eytzinger_index<kmer_type> index;
+
+  static const kmer_type& key_of(const kmer_packet<kmer_type> &pkt) { return pkt.kmer; }
+
+  void build(const arena_vector<kmer_packet<kmer_type>> *counts) {
+    this->counts = counts;
+    index.build(counts->data(), counts->size(), key_of);
+  }
+
+  inline count_t lookup(const kmer_type &kmer) const {
+    int64_t idx = index.find(counts->data(), kmer, key_of);
+    return (idx >= 0) ? (*counts)[idx].count : 0;
+  }
+};
+
+/* 
+ * Query service: QUERY packets take k-mers to their owner PE, which 
+ * answers them from its count_table and sends the packet back as a REPLY. 
+ * REPLY is done once QUERY is, as in the bale index-gather selector.
+ */
+template<int K, int BIGK>
+class query_handler: public hclib::Selector<2, query_packet<typename kmer_traits<K>::type, BIGK>> {
+public: 
+  typedef typename kmer_traits<K>::type kmer_type;
+  typedef query_packet<kmer_type, BIGK> packet_type;
+
+  uint64_t served = 0, found = 0; // k-mers answered by this PE
+
+  query_handler(const count_table<kmer_type> *table, std::vector<count_t> *counts) 
+    : table_(table), counts_(counts) {
+
+    this->mb[QUERY].process = [this] (packet_type pkt, int sender_pe) {
+      this->recv_query(pkt, sender_pe);
+    };
+    this->mb[REPLY].process = [this] (packet_type pkt, int sender_pe) {
+      this->recv_reply(pkt, sender_pe);
+    };
   }
 
 private: 
-  std::vector<kmer_t> *dbg_;
-  std::vector<kmer_packet> *heavydbg_;
-  uint32_t dbg_size, heavydbg_size;
-  void recv_kmer(bigk_packet pkt, int sender_pe);
+  const count_table<kmer_type> *table_;
+  std::vector<count_t> *counts_;
+  void recv_query(packet_type pkt, int sender_pe);
+  void recv_reply(packet_type pkt, int sender_pe);
+};
+
+/*
+ * One parsing thread of a PE: the bytes [read_idx, read_end) of the 
+ * current window left to parse, its C3 buffer and scratch arrays. 
+ * 
+ * A worker also stages its flushed buffer for the communication thread: 
+ * the k-mers (runs of equal k-mers with hitter) grouped by owner PE, those 
+ * of PE p at [first[p], first[p + 1]). Only the worker writes its staging 
+ * and the communication thread reads it after the parsing round, so no 
+ * locks are needed.
+ */
+template<typename kmer_type>
+struct kcount_worker {
+  uint64_t read_idx = 0, read_end = 0;
+  bool done_parsing = false;
+  std::vector<kmer_type> buf;
+  uint64_t kmers_in_buffer = 0;
+  std::vector<uint8_t> base_vec;
+  std::vector<kmer_type> rc_vec;
+  std::vector<uint64_t> packed; // get_kmers64 words, k <= 32
+
+  std::vector<kmer_type> staged;
+  std::vector<count_t> staged_counts; // with hitter
+  std::vector<count_t> counts;
+  std::vector<int> owners;
+  std::vector<uint32_t> first;
+};
+
+/* counters of the counting rounds, printed with BENCHMARK */
+struct kcount_stats {
+  uint64_t npkts = 0, remote_pkts = 0; // packets received, from another node
+  uint64_t recv_bytes = 0; // receiver memory at the end of an exchange, max over the rounds
+  uint64_t table_kmers = 0, table_spilled = 0; // -r hash
+  uint64_t spilled_runs = 0, spilled_bytes = 0; // --mem-limit
+  uint64_t heavy_size = 0, heavy_hits = 0; // heavy counts received, joined with a received k-mer
+  uint64_t merge_bytes = 0;
+  double sort_time = 0, merge_time = 0;
 };
 
 // kmer counting class
+template<int K, int BIGK>
 class kmercounter {
 private:
 public:
-  std::vector<kmer_t> *vectordbg;
-  std::vector<kmer_packet> *heavydbg;
-  std::vector<kmer_packet> *lightdbg;
-  char* rchunk;
+  typedef typename kmer_traits<K>::type kmer_type;
+  typedef bigk_packet<kmer_type, BIGK> packet_type;
+
+  static_assert(K > 0 && 2 * K <= 8 * static_cast<int>(sizeof(kmer_type)), "k-mer does not fit in kmer_type");
+
+  static constexpr kmer_type KMER_MASK = kmer_traits<K>::mask();
+
+  /* minimizer mode: m-mers of M bases, super-k-mers of at most SUPER_MAX_BASES bases */
+  static constexpr int M = (MINIMIZERLEN < K) ? MINIMIZERLEN : K;
+  static_assert(M > 0 && M <= 32, "a minimizer must fit in 64 bits");
+  static constexpr uint64_t MMER_MASK = (~0ULL) >> (64 - 2 * M);
+  /* codec mode: the owner hash of a 64-bit k-mer is a bijection */
+  static constexpr bool CODEC_KEYS = std::is_same<kmer_type, uint64_t>::value;
+
+  static constexpr int SUPER_MAX_BASES = (4 * (packet_type::PAYLOAD_BYTES - 1) < 255) ? 4 * (packet_type::PAYLOAD_BYTES - 1) : 255;
+
+  arena_vector<kmer_type> *vectordbg;
+  arena_vector<kmer_packet<kmer_type>> *heavydbg; // NULL unless hitter, node_agg or -r hash
+  arena_vector<kmer_packet<kmer_type>> *countdbg; // final sorted (k-mer, count) table
+  uint64_t expected; // k-mers a PE is expected to receive per round, the receive arrays are presized to it
+  uint64_t expected_distinct; // -e: distinct k-mers of a PE per round, 0 unknown
+  std::vector<kcount_worker<kmer_type>> workers; // one per parsing thread
+  int nthreads;
+  std::vector<int> pe_node; // node of every PE
+  bool node_agg; // two-level exchange through a PE of the own node
+  std::vector<int> route; // node aggregation: PE a k-mer of every owner is sent to
+  transit_buffers<kmer_type> *transit; // node aggregation: k-mers to forward, NULL otherwise
+  recv_buckets<K> *buckets; // received k-mers by key prefix, NULL with RECV_RADIX_BITS 0
+  recv_table<kmer_type> *table; // -r hash: counts of the received k-mers, NULL otherwise
+  recv_backend receiver;
+  uint64_t table_bytes; // -r hash: most memory of the table
+  int rounds; // -R: passes over the input, each counting one slice of the k-mers
+  int round = 0; // the current one
+  spill_runs<kmer_packet<kmer_type>> *spill; // --mem-limit: sorted runs on disk, NULL otherwise
+  std::vector<packet_type> transit_pkts, transit_heavy_pkts;
+  uint64_t forwarded = 0; // node aggregation: k-mer copies sent to a PE of the own node
+  fqreader* reader;
+  char* rchunk; // current input window
+  uint64_t rchunk_len;
+  uint64_t bucket_size;
+  bool canonical;
+  bool hitter; // count the repeats of a flush locally and send them as HEAVY packets
+  bool minimizer; // send super-k-mers to the owner of their minimizer
+  std::vector<uint64_t> mmer_hash; // minimizer mode: hashes of the m-mers of a read
+  std::vector<uint8_t> super_buf; // minimizer mode: owner (int) and packed super-k-mer records
+  key_codec *codec; // delta coded packets, NULL unless enabled
+  std::vector<frame_cursor> frames; // codec mode: next entry of every destination's frame
+  std::string output_file;
+  std::string query_file;
+  uint64_t min_count, max_count;
+  bool solid;
+  std::string hist_file;
+
+  #if HITTER_SKETCH
+  hot_kmers<kmer_type> *hot; // NULL unless hitter
+  uint64_t nflushes = 0;
+  #endif
 
   const uint8_t pre_delete_mask[4] = {0x7F, 0xBF, 0xDF, 0xEF};
   const uint8_t suf_delete_mask[4] = {0xF7, 0xFB, 0xFD, 0xFE};
 
-  kmercounter(char* read_chunk, std::vector<kmer_t> &vectordbg) {
+  kmercounter(fqreader &reader, arena_vector<kmer_type> &vectordbg, const kcount_config &cfg) {
     
-    this->rchunk = read_chunk;
+    this->reader = &reader;
+    this->rchunk = NULL;
+    this->rchunk_len = 0;
+    this->bucket_size = cfg.bucket_size;
+    this->canonical = cfg.canonical;
+    this->minimizer = cfg.minimizer && SUPER_MAX_BASES >= K;
+    this->hitter = cfg.hitter && !minimizer;
+    if (cfg.minimizer && !minimizer && CURR_PE == 0) {
+      std::cout << "C2 packets can't hold a super-k-mer of k = " << K << ", sending k-mers" << std::endl;
+    }
+
+    this->codec = NULL;
+    if (cfg.codec && CODEC_KEYS && !minimizer) {
+      this->codec = new key_codec(TOTAL_PE, cfg.bucket_size);
+    } else if (cfg.codec && CURR_PE == 0) {
+      std::cout << "Coded packets need k <= 32 and no minimizers, sending k-mers" << std::endl;
+    }
+
+    this->node_agg = cfg.node_agg && !minimizer && !codec;
+    if (cfg.node_agg && !node_agg && CURR_PE == 0) {
+      std::cout << "Minimizer and coded packets go straight to their owner, no node aggregation" << std::endl;
+    }
+    this->rounds = std::max(1, cfg.rounds);
+    this->expected = expected_kmers(cfg.est_kmers);
+    this->expected_distinct = cfg.est_distinct / rounds;
+    this->transit = node_agg ? new transit_buffers<kmer_type>(expected) : NULL;
+    this->receiver = cfg.receiver;
+    this->spill = cfg.mem_limit ? new spill_runs<kmer_packet<kmer_type>>(cfg.mem_limit, cfg.spill_dir, CURR_PE) : NULL;
+    // with a limit the table takes at most half of it
+    this->table_bytes = spill ? std::min<uint64_t>(RECV_TABLE_MAX_BYTES, cfg.mem_limit / 2) : RECV_TABLE_MAX_BYTES;
+    this->table = (receiver == RECV_HASH) ? new recv_table<kmer_type>(table_bytes, expected_distinct) : NULL;
+    #if RECV_RADIX_BITS > 0
+    this->buckets = new recv_buckets<K>(expected);
+    #else
+    this->buckets = NULL;
+    #endif
+
+    this->nthreads = (minimizer || codec) ? 1 : cfg.threads;
+    if (nthreads != cfg.threads && CURR_PE == 0) {
+      std::cout << "Minimizer and coded packets parse on one thread per PE" << std::endl;
+    }
+    this->output_file = cfg.output_file;
+    this->query_file = cfg.query_file;
+    this->min_count = cfg.min_count;
+    this->max_count = cfg.max_count;
+    this->solid = cfg.solid;
+    this->hist_file = cfg.hist_file;
+
+    // the longest piece of a read parsed at once yields bucket_size k-mers
+    this->workers.resize(nthreads);
+    for (kcount_worker<kmer_type> &w : workers) {
+      w.buf.resize(cfg.bucket_size);
+      w.base_vec.resize(cfg.bucket_size + K);
+      w.rc_vec.resize(cfg.bucket_size + K);
+      if (std::is_same<kmer_type, uint64_t>::value) w.packed.resize((cfg.bucket_size + K) / 32 + 2);
+      w.first.resize(TOTAL_PE + 1);
+    }
+    if (minimizer) this->mmer_hash.resize(cfg.bucket_size + K);
+
     this->vectordbg = &vectordbg;
-    this->vectordbg->resize(INIT_DBG_SIZE);
+    this->heavydbg = (hitter || node_agg || table) ? new arena_vector<kmer_packet<kmer_type>>() : NULL;
+    presize();
 
-    #if HITTER
-    this->heavydbg = new std::vector<kmer_packet>();
-    this->heavydbg->resize(INIT_DBG_SIZE);
+    #if HITTER_SKETCH
+    this->hot = hitter ? new hot_kmers<kmer_type>() : NULL;
     #endif
 
-    this->lightdbg = new std::vector<kmer_packet>();
-    this->lightdbg->resize(INIT_DBG_SIZE);
+    this->countdbg = new arena_vector<kmer_packet<kmer_type>>();
+    // at most every received k-mer is distinct
+    arena_reserve(*countdbg, expected_distinct ? (expected_distinct + expected_distinct / 4) * rounds : expected * rounds);
 
     perform_kcount();
+    if (solid || min_count > 1 || max_count < static_cast<uint64_t>(MAX_KMER_COUNT) || !hist_file.empty()) filter_kmers();
+    if (!output_file.empty()) write_table();
+    if (!query_file.empty()) serve_queries();
   }
 
   ~kmercounter() {
-    #if HITTER
     delete heavydbg;
+    #if HITTER_SKETCH
+    delete hot;
     #endif
+    delete countdbg;
+    delete codec;
+    delete transit;
+    delete buckets;
+    delete table;
+    delete spill;
+  }
+
+  static constexpr kmer_type set_kmer_fast(const uint8_t *s) {
+    kmer_type kmer = 0;
+    for (int i = 0; i < K; ++i) {
+      kmer <<= 2;
+      kmer |= static_cast<kmer_type>(s[i]);
+    }
+    return kmer;
+  }
+
+  static constexpr kmer_type update_kmer_fast(kmer_type kmer, uint8_t s) {
+    kmer <<= 2;
+    kmer |= static_cast<kmer_type>(s);
+    return (kmer & KMER_MASK);
+  }
+
+  /* rolling reverse complement, complement(b) == b ^ 3 for the char2base codes */
+  static constexpr kmer_type update_rc_fast(kmer_type rc, uint8_t s) {
+    rc >>= 2;
+    rc |= static_cast<kmer_type>(s ^ 0x3) << (2 * (K - 1));
+    return rc;
+  }
+
+  static constexpr kmer_type set_rc_fast(const uint8_t *s) {
+    kmer_type rc = 0;
+    for (int i = 0; i < K; ++i) {
+      rc = update_rc_fast(rc, s[i]);
+    }
+    return rc;
+  }
+
+  /* min(fwd, rc) without a data dependent branch */
+  static inline kmer_type canonical_kmer(const kmer_type &fwd, const kmer_type &rc) {
+    if constexpr (std::is_integral<kmer_type>::value || std::is_same<kmer_type, __uint128_t>::value) {
+      return fwd ^ ((fwd ^ rc) & -static_cast<kmer_type>(rc < fwd));
+    } else {
+      return (rc < fwd) ? rc : fwd;
+    }
   }
 
-  void get_kmers(std::vector<kmer_t> &sendbuf, const uint8_t* read, int readlen, uint64_t &kmers_in_buffer);
-  void read_till_buf_max(uint64_t &read_idx, std::vector<kmer_t> &sendbuf, bool &done_parsing, uint64_t &kmers_in_buffer);
-  void flush_buffer(std::vector<kmer_t> &kcount_buffer, uint64_t &kmers_in_buffer, kmer_handler* kmer_selector, 
-    std::vector<bigk_packet> &heavy_send_pkt_vec, std::vector<bigk_packet> &big_send_pkt_vec);
+  template<bool CANONICAL>
+  void get_kmers(kcount_worker<kmer_type> &w, const uint8_t* read, int readlen);
+  /* hash of the minimizer of bases[0, n): the smallest hash of its (canonical) m-mers */
+  static uint64_t minimizer_hash(const uint8_t *bases, int n, bool canonical);
+
+  template<bool CANONICAL>
+  void get_superkmers(const uint8_t* read, int readlen, uint64_t &kmers_in_buffer);
+  void add_superkmer(const uint8_t* bases, int nbases, uint64_t hash);
+  void send_superkmers(kmer_handler<K, BIGK>* kmer_selector, std::vector<packet_type> &normal_vec);
+  void add_in_coded_packet(std::vector<packet_type> &coded_vec, uint64_t hash, count_t count, 
+    kmer_handler<K, BIGK>* kmer_selector);
+  void flush_coded(std::vector<kmer_type> &kcount_buffer, uint64_t kmers_in_buffer, kmer_handler<K, BIGK>* kmer_selector, 
+    std::vector<packet_type> &hitter_vec, std::vector<packet_type> &coded_vec);
+  template<bool CANONICAL>
+  void read_till_buf_max(kcount_worker<kmer_type> &w);
+  void split_window();
+  void stage_buffer(kcount_worker<kmer_type> &w, int npes) const;
+  void send_staged(kmer_handler<K, BIGK>* kmer_selector, std::vector<packet_type> &hitter_vec, 
+    std::vector<packet_type> &normal_vec);
+  void send_kmer(const kmer_type &kmer, count_t count, int owner, kmer_handler<K, BIGK>* kmer_selector, 
+    std::vector<packet_type> &hitter_vec, std::vector<packet_type> &normal_vec);
+  void forward_transit(uint64_t &npkts, uint64_t &remote_pkts);
+  uint64_t expected_kmers(uint64_t estimate) const;
+  void presize();
+  uint64_t count_buckets(uint64_t heavy_size, uint64_t &received, double &sort_time);
+  void count_round(kcount_stats &st);
+  void send_hot(kmer_handler<K, BIGK>* kmer_selector, std::vector<packet_type> &hitter_vec);
+  void flush_buffer(kcount_worker<kmer_type> &w, kmer_handler<K, BIGK>* kmer_selector, 
+    std::vector<packet_type> &heavy_send_pkt_vec, std::vector<packet_type> &big_send_pkt_vec);
 
   void perform_kcount();
+  void filter_kmers();
+  void write_table();
+  void serve_queries();
 };
 
+/* 
+ * Runs the kmercounter specialization matching cfg.kmer_len and cfg.pkt_size 
+ * on the input windows of an open fqreader stream. 
+ * Returns false if that pair was not compiled into the binary.
+ */
+bool count_kmers(fqreader &reader, const kcount_config &cfg);
+
+/* BIGKSIZE values compiled for k-mer length kmer_len, in increasing order */
+std::vector<int> compiled_pkt_sizes(int kmer_len);
+
 #endif 
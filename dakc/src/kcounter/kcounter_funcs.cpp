@@ -22,90 +22,229 @@
 #include <immintrin.h>
 
 // Functions of the kmercounter class ------------------------------------------
-kmer_t inline set_kmer_fast(const uint8_t *s) {
-  kmer_t kmer = 0;
-  for (int i = 0; i < KMERLEN; ++i) {
-    kmer <<= 2;
-    kmer |= static_cast<uint64_t>(s[i]);
-  }
-  return kmer;
-}
-
-kmer_t inline update_kmer_fast(kmer_t kmer, uint8_t s) {
-  kmer <<= 2;
-  kmer |= static_cast<kmer_t>(s);
-  return (kmer & KMER_MASK);
-}
-
-void kmercounter::get_kmers(std::vector<kmer_t> &send_buf, 
-  const uint8_t* read, int readlen, uint64_t &kmers_in_buffer) {
+template<int K, int BIGK>
+template<bool CANONICAL>
+void kmercounter<K, BIGK>::get_kmers(kcount_worker<kmer_type> &w, const uint8_t* read, int readlen) {
 /*
- * Updates the kmer_send_buf with kmers extracted from the read and 
- * returns the number of kmers extracted.
+ * Appends the kmers extracted from the read to the worker's buffer.
  * Does NOT check for 'N' characters inside this function. Assumes 
  * reads contains only A,T,C,G characters
+ * 
+ * With CANONICAL, the reverse complement is rolled alongside the forward 
+ * k-mer into w.rc_vec, and a second branch-free pass (vectorized by the 
+ * compiler for 64-bit k-mers) keeps min(fwd, rc) in the send buffer.
+ * With a vector kernel, 64-bit k-mers are cut out of the packed read by 
+ * get_kmers64 instead.
  */
 
   // define the variables 
-  kmer_t curr_kmer, prv_kmer;
+  kmer_type curr_kmer, prv_kmer;
+  kmer_type curr_rc;
+  kmer_type* send_buf = w.buf.data();
+  uint64_t kmers_in_buffer = w.kmers_in_buffer;
+  uint64_t first_kmer = kmers_in_buffer;
 
   // input string is smaller than a kmer 
-  if (__builtin_expect(readlen < KMERLEN, 0))  return;
+  if (__builtin_expect(readlen < K, 0))  return;
+
+  if constexpr (std::is_same<kmer_type, uint64_t>::value) {
+    if (simd_kmers_level() != SIMD_SCALAR) {
+      get_kmers64(read, readlen, K, CANONICAL, w.packed.data(), send_buf + kmers_in_buffer);
+      w.kmers_in_buffer += readlen - K + 1;
+      return;
+    }
+  }
 
   // deal with the first k-mer separately (suffix only)
   curr_kmer = set_kmer_fast(read);
   send_buf[kmers_in_buffer++] = curr_kmer;
   prv_kmer = curr_kmer;
 
-  if (__builtin_expect(readlen == KMERLEN, 0)) return;
+  kmer_type* rc_buf = w.rc_vec.data();
+  if constexpr (CANONICAL) {
+    curr_rc = set_rc_fast(read);
+    rc_buf[0] = curr_rc;
+  }
   
-  for (int i = KMERLEN; i < readlen; i++) {
+  for (int i = K; i < readlen; i++) {
     curr_kmer = update_kmer_fast(prv_kmer, read[i]);
     send_buf[kmers_in_buffer++] = curr_kmer;
     prv_kmer = curr_kmer;
+
+    if constexpr (CANONICAL) {
+      curr_rc = update_rc_fast(curr_rc, read[i]);
+      rc_buf[i - K + 1] = curr_rc;
+    }
+  }
+  w.kmers_in_buffer = kmers_in_buffer;
+
+  if constexpr (CANONICAL) {
+    kmer_type* out = send_buf + first_kmer;
+    const kmer_type* rc = rc_buf;
+    const int nkmers = readlen - K + 1;
+
+    for (int i = 0; i < nkmers; i++) {
+      out[i] = canonical_kmer(out[i], rc[i]);
+    }
+  }
+}
+
+template<int K, int BIGK>
+uint64_t kmercounter<K, BIGK>::minimizer_hash(const uint8_t *bases, int n, bool canonical) {
+  uint64_t fwd = 0, rc = 0, min_hash = UINT64_MAX;
+
+  for (int i = 0; i < n; i++) {
+    fwd = ((fwd << 2) | bases[i]) & MMER_MASK;
+    rc = (rc >> 2) | (static_cast<uint64_t>(bases[i] ^ 0x3) << (2 * (M - 1)));
+    if (i >= M - 1) {
+      uint64_t mmer = canonical ? std::min(fwd, rc) : fwd;
+      min_hash = std::min(min_hash, MurmurHash64A(mmer, OWNER_SEED));
+    }
   }
+  return min_hash;
 }
 
-void kmercounter::read_till_buf_max(uint64_t &read_idx, 
-  std::vector<kmer_t> &kmer_send_buf, bool &done_parsing, uint64_t &kmers_in_buffer) {
+template<int K, int BIGK>
+template<bool CANONICAL>
+void kmercounter<K, BIGK>::get_superkmers(const uint8_t* read, int readlen, uint64_t &kmers_in_buffer) {
 /*
- * Parse the read_vector and put the kmers into the kcount_buffer 
- * till either (1.) the max buffer size will exceed after adding kmers 
- * from the next read, or (2.) we exhaust the read_vector. 
+ * Minimizer mode counterpart of get_kmers: splits the read into 
+ * super-k-mers, maximal runs of consecutive k-mers sharing a minimizer, 
+ * and stages them for the owner PE of that minimizer. The minimizer of a 
+ * k-mer is its m-mer of smallest hash (canonical m-mers with CANONICAL, so 
+ * both strands of a k-mer agree), kept by a sliding window minimum over 
+ * the W = K - M + 1 m-mers of every k-mer.
  */
-  char* rd = rchunk + read_idx;
+  constexpr int W = K - M + 1;
+  const int max_kmers = SUPER_MAX_BASES - K + 1;
+
+  // input string is smaller than a kmer 
+  if (__builtin_expect(readlen < K, 0))  return;
+
+  uint64_t fwd = 0, rc = 0;
+  for (int i = 0; i < readlen; i++) {
+    fwd = ((fwd << 2) | read[i]) & MMER_MASK;
+    rc = (rc >> 2) | (static_cast<uint64_t>(read[i] ^ 0x3) << (2 * (M - 1)));
+    if (i >= M - 1) {
+      uint64_t mmer = CANONICAL ? std::min(fwd, rc) : fwd;
+      mmer_hash[i - M + 1] = MurmurHash64A(mmer, OWNER_SEED);
+    }
+  }
+
+  const uint64_t* h = mmer_hash.data();
+  const int nkmers = readlen - K + 1;
+  int first = 0; // first k-mer of the current super-k-mer
+  int minpos = std::min_element(h, h + W) - h;
+  uint64_t curr = h[minpos];
+
+  for (int i = 1; i < nkmers; i++) {
+    // k-mer i covers the m-mers [i, i + W)
+    if (minpos < i) {
+      minpos = std::min_element(h + i, h + i + W) - h;
+    } else if (h[i + W - 1] < h[minpos]) {
+      minpos = i + W - 1;
+    }
+
+    if (h[minpos] != curr || i - first == max_kmers) {
+      add_superkmer(read + first, i - first + K - 1, curr);
+      first = i;
+      curr = h[minpos];
+    }
+  }
+  add_superkmer(read + first, nkmers - first + K - 1, curr);
+  kmers_in_buffer += nkmers;
+}
+
+template<int K, int BIGK>
+void kmercounter<K, BIGK>::add_superkmer(const uint8_t* bases, int nbases, uint64_t hash) {
+  if (rounds > 1 && hash_owner(hash, rounds) != round) return; // -R: another round's minimizers
+  int owner = hash % TOTAL_PE;
+  size_t pos = super_buf.size();
+
+  super_buf.resize(pos + sizeof(int) + 1 + (nbases + 3) / 4, 0);
+  memcpy(&super_buf[pos], &owner, sizeof(int));
+
+  uint8_t* rec = &super_buf[pos + sizeof(int)];
+  rec[0] = static_cast<uint8_t>(nbases);
+  for (int i = 0; i < nbases; i++) {
+    rec[1 + i / 4] |= bases[i] << (6 - 2 * (i % 4));
+  }
+}
+
+template<int K, int BIGK>
+template<bool CANONICAL>
+void kmercounter<K, BIGK>::read_till_buf_max(kcount_worker<kmer_type> &w) {
+/*
+ * Parse the worker's range of the read chunk and put the kmers into its 
+ * buffer till either (1.) the max buffer size will exceed after adding 
+ * kmers from the next read, or (2.) we exhaust the range. 
+ * 
+ * Reads are newline separated and may have any length; the end of each 
+ * read is found with memchr. A read of n bases adds at most n - K + 1 
+ * k-mers, so the flush decision uses the real length of what is left. 
+ * A read that does not fit into an empty buffer is parsed in pieces that 
+ * overlap by K - 1 bases, read_idx then points inside the read. Padding 
+ * 'M' characters (older .txt inputs) are treated like 'N'. Only the worker 
+ * is written, so threads parse disjoint ranges at the same time.
+ */
+  const char* chunk_end = rchunk + w.read_end;
+  uint64_t &read_idx = w.read_idx, &kmers_in_buffer = w.kmers_in_buffer;
+  std::vector<uint8_t> &base_vec = w.base_vec;
+  uint64_t rd_len, piece_len, space;
   int i, left_idx;
 
-  while (kmers_in_buffer <= (KCOUNT_BUCKET_SIZE - READLEN)) {
-    // check for N characters and send the read to get_kmers function
-    // then process the read and dump in the kmer_send_buf
-    left_idx = 0;
+  while (read_idx < w.read_end) {
+    const char* rd = rchunk + read_idx;
+    const char* nl = static_cast<const char*>(memchr(rd, '\n', chunk_end - rd));
+    rd_len = (nl ? nl : chunk_end) - rd;
 
-    static std::vector<uint8_t> base_vec(READLEN);
+    space = bucket_size - kmers_in_buffer;
+    piece_len = rd_len;
 
-    for (i = 0; i < READLEN; i++) {
-      base_vec[i] = char2base(rd[i]);
-      if (__builtin_expect(base_vec[i] == 0xFF, 0)) {
-        get_kmers(kmer_send_buf, &base_vec[left_idx], (i - left_idx), kmers_in_buffer);
-        left_idx = i + 1;
-      }
-      if (__builtin_expect(base_vec[i] == 0xF0, 0)) {
-        break; /* M detected, exit this for loop */
+    if (rd_len >= K && rd_len - K + 1 > space) {
+      // flush first if the read fits into an empty buffer
+      if (kmers_in_buffer > 0 && rd_len - K + 1 <= bucket_size) return;
+      piece_len = space + K - 1;
+    }
+
+    // encode the piece, then split it at N characters (if there are any) 
+    // and send the parts to get_kmers that dumps them in the buffer
+    left_idx = 0;
+    i = static_cast<int>(piece_len);
+
+    if (__builtin_expect(encode_bases(rd, i, &base_vec[0]) > 0, 0)) {
+      for (i = 0; i < static_cast<int>(piece_len); i++) {
+        if (base_vec[i] > 0x3) {
+          if (minimizer) get_superkmers<CANONICAL>(&base_vec[left_idx], (i - left_idx), kmers_in_buffer);
+          else get_kmers<CANONICAL>(w, &base_vec[left_idx], (i - left_idx));
+          left_idx = i + 1;
+        }
       }
     }
 
-    if (left_idx < READLEN - 1) {
-      get_kmers(kmer_send_buf, &base_vec[left_idx], (i - left_idx), kmers_in_buffer);
+    if (left_idx < i) {
+      if (minimizer) get_superkmers<CANONICAL>(&base_vec[left_idx], (i - left_idx), kmers_in_buffer);
+      else get_kmers<CANONICAL>(w, &base_vec[left_idx], (i - left_idx));
     }
 
-    // move on to the next read in the (*rvec)
-    read_idx += READLEN + 1; // skip current read and one \n char
-    if (rchunk[read_idx] != '\0') { 
-      // update the read variable
-      rd = rchunk + read_idx;
-    } else {
-      done_parsing = true;
-      break; // exits the while loop
+    if (piece_len < rd_len) {
+      // continue with the rest of this read after the flush
+      read_idx += piece_len - K + 1;
+      return;
     }
+
+    // move on to the next read, skip current read and one \n char
+    read_idx += rd_len + 1;
   }
+
+  w.done_parsing = true;
 }
+
+#define INSTANTIATE_KCOUNTER_FUNCS(K_, BIGK_) \
+  template void kmercounter<K_, BIGK_>::read_till_buf_max<false>( \
+    kcount_worker<typename kmer_traits<K_>::type>&); \
+  template void kmercounter<K_, BIGK_>::read_till_buf_max<true>( \
+    kcount_worker<typename kmer_traits<K_>::type>&); \
+  template uint64_t kmercounter<K_, BIGK_>::minimizer_hash(const uint8_t*, int, bool);
+
+DAKC_FOR_EACH_SPECIALIZATION(INSTANTIATE_KCOUNTER_FUNCS)
@@ -0,0 +1,129 @@
+#ifndef KMER_CODEC_H
+#define KMER_CODEC_H
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#ifndef CODEC_ESCAPE
+#define CODEC_ESCAPE 24 /* a unary quotient this long is followed by an absolute key */
+#endif
+
+#ifndef CODEC_MAX_COUNT
+#define CODEC_MAX_COUNT 16 /* copies of a key per entry, longer runs take several */
+#endif
+
+/* position of the next entry of a frame and the key it is coded against */
+struct frame_cursor {
+  uint64_t prev;
+  uint32_t bits;
+};
+
+/*
+ * Compressed frames of keys for one destination PE. The keys of a frame
+ * are the owner hashes of 64-bit k-mers minus the first hash of the range
+ * the destination owns (below 2^64 / npes), sent in increasing order 
+ * within a flush. Byte 0 of a frame holds the Rice parameter b, entries follow as a
+ * little endian bit stream:
+ *
+ *   key - prev = d:  d >> b in unary (ones ended by a zero), d's low b bits
+ *   key < prev, or d >> b >= CODEC_ESCAPE:
+ *                    CODEC_ESCAPE ones, then the key in key_bits bits
+ *   count:           count - 1 in unary, 1 <= count <= CODEC_MAX_COUNT
+ *
+ * prev is 0 at the start of a frame. With D keys per flush spread over
+ * all PEs, the gaps of one destination average 2^64 / D whatever the
+ * number of PEs, so b = 64 - log2(D) and a distinct k-mer takes about
+ * 66 - log2(D) bits, plus one bit per further copy.
+ */
+class key_codec {
+public:
+  int rice_bits, key_bits;
+
+  key_codec(int npes, uint64_t keys_per_flush) {
+    int log_npes = 63 - __builtin_clzll(std::max(npes, 1));
+    int log_keys = 64 - __builtin_clzll(std::max<uint64_t>(keys_per_flush, 2) - 1); // ceil(log2)
+    key_bits = 64 - log_npes;
+    rice_bits = std::max(0, std::min(key_bits, 64 - log_keys));
+  }
+
+  static inline void reset(uint8_t* frame, int frame_bytes, frame_cursor &c, int rice_bits) {
+    memset(frame, 0, frame_bytes);
+    frame[0] = static_cast<uint8_t>(rice_bits);
+    c.prev = 0;
+    c.bits = 8;
+  }
+
+  inline uint32_t entry_bits(const frame_cursor &c, uint64_t key, int count) const {
+    if (key < c.prev || ((key - c.prev) >> rice_bits) >= CODEC_ESCAPE) return CODEC_ESCAPE + key_bits + count;
+    return ((key - c.prev) >> rice_bits) + 1 + rice_bits + count;
+  }
+
+  inline void put(uint8_t* frame, frame_cursor &c, uint64_t key, int count) const {
+    uint64_t q = (key >= c.prev) ? (key - c.prev) >> rice_bits : CODEC_ESCAPE;
+    if (q >= CODEC_ESCAPE) {
+      put_bits(frame, c.bits, (1ULL << CODEC_ESCAPE) - 1, CODEC_ESCAPE);
+      put_bits(frame, c.bits, key, key_bits);
+    } else {
+      put_bits(frame, c.bits, (1ULL << q) - 1, q + 1);
+      put_bits(frame, c.bits, key - c.prev, rice_bits);
+    }
+    put_bits(frame, c.bits, (1ULL << (count - 1)) - 1, count);
+    c.prev = key;
+  }
+
+  /* calls emit(key, count) for the first n entries of a frame */
+  template<typename emit_fn>
+  void decode(const uint8_t* frame, int n, emit_fn emit) const {
+    const int b = frame[0];
+    uint32_t pos = 8;
+    uint64_t key = 0;
+
+    for (int i = 0; i < n; i++) {
+      int q = unary(frame, pos, CODEC_ESCAPE);
+      if (q == CODEC_ESCAPE) {
+        key = get_bits(frame, pos, key_bits);
+      } else {
+        key += (static_cast<uint64_t>(q) << b) | get_bits(frame, pos, b);
+      }
+      emit(key, unary(frame, pos, CODEC_MAX_COUNT) + 1);
+    }
+  }
+
+private:
+  /* n <= 64 bits of v, lowest first */
+  static inline void put_bits(uint8_t* buf, uint32_t &pos, uint64_t v, int n) {
+    while (n > 0) {
+      int off = pos & 7, take = std::min(n, 8 - off);
+      buf[pos >> 3] |= static_cast<uint8_t>((v & ((1U << take) - 1)) << off);
+      v = (take < 64) ? v >> take : 0;
+      n -= take;
+      pos += take;
+    }
+  }
+
+  static inline uint64_t get_bits(const uint8_t* buf, uint32_t &pos, int n) {
+    uint64_t v = 0;
+    for (int got = 0; got < n; ) {
+      int off = pos & 7, take = std::min(n - got, 8 - off);
+      v |= static_cast<uint64_t>((buf[pos >> 3] >> off) & ((1U << take) - 1)) << got;
+      got += take;
+      pos += take;
+    }
+    return v;
+  }
+
+  /* ones up to the next zero (consumed), at most limit ones (no zero then) */
+  static inline int unary(const uint8_t* buf, uint32_t &pos, int limit) {
+    int q = 0;
+    while (q < limit) {
+      int bit = (buf[pos >> 3] >> (pos & 7)) & 1;
+      pos++;
+      if (!bit) break;
+      q++;
+    }
+    return q;
+  }
+};
+
+#endif
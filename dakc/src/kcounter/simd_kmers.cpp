@@ -0,0 +1,338 @@
+#include <cstdint>
+
+#include <immintrin.h>
+
+#include "common.hpp"
+#include "simd_kmers.hpp"
+
+uint64_t MurmurHash64A(uint64_t key, uint64_t seed); // kcounter.cpp
+
+/* MurmurHash64A on one word, h0 = seed ^ (8 * m) */
+#define MURMUR_M 0xc6a4a7935bd1e995ULL
+#define MURMUR_R 47
+
+// Scalar kernels, also the tails of the vector ones -------------------------
+static int encode_scalar(const char* in, int n, uint8_t* out) {
+  int invalid = 0;
+  for (int i = 0; i < n; i++) {
+    out[i] = char2base(in[i]);
+    invalid += (out[i] > 0x3);
+  }
+  return invalid;
+}
+
+/* words[j] holds bases [32j, 32j + 32), the first one in the high bits, zero padded */
+static void pack_scalar(const uint8_t* bases, int n, uint64_t* words, int first_word) {
+  const int nwords = (n + 31) / 32;
+  for (int j = first_word; j < nwords; j++) {
+    uint64_t w = 0;
+    for (int t = 32 * j; t < 32 * j + 32; t++) w = (w << 2) | (t < n ? bases[t] : 0);
+    words[j] = w;
+  }
+  words[nwords] = 0;
+}
+
+static inline uint64_t kmer_at(const uint64_t* words, int i, int k, uint64_t mask) {
+  const int j = i >> 5, r = i & 31;
+  __uint128_t x = (static_cast<__uint128_t>(words[j]) << 64) | words[j + 1];
+  return static_cast<uint64_t>(x >> (128 - 2 * r - 2 * k)) & mask;
+}
+
+/* reverses the 2-bit bases of the word, then complements them (b ^ 3) */
+static inline uint64_t revcomp64(uint64_t x, int k, uint64_t mask) {
+  x = __builtin_bswap64(x);
+  x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+  x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+  return (x >> (64 - 2 * k)) ^ mask;
+}
+
+static void extract_scalar(const uint64_t* words, int from, int nkmers, int k, bool canonical, uint64_t* out) {
+  const uint64_t mask = (~0ULL) >> (64 - 2 * k);
+  for (int i = from; i < nkmers; i++) {
+    uint64_t x = kmer_at(words, i, k, mask);
+    if (canonical) {
+      uint64_t rc = revcomp64(x, k, mask);
+      x = (rc < x) ? rc : x;
+    }
+    out[i] = x;
+  }
+}
+
+// AVX2 -----------------------------------------------------------------------
+__attribute__((target("avx2")))
+static int encode_avx2(const char* in, int n, uint8_t* out) {
+  /* code of a letter by its low nibble: A 0x1, C 0x3, T 0x4, G 0x7 */
+  const __m256i lut = _mm256_setr_epi8(
+    -1, 1, -1, 0, 2, -1, -1, 3, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 1, -1, 0, 2, -1, -1, 3, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m256i nibble = _mm256_set1_epi8(0x0F), lower = _mm256_set1_epi8(0x20), ones = _mm256_set1_epi8(-1);
+  int invalid = 0, i = 0;
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+    __m256i code = _mm256_shuffle_epi8(lut, _mm256_and_si256(c, nibble));
+    __m256i u = _mm256_or_si256(c, lower);
+    __m256i valid = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(u, _mm256_set1_epi8('a')), _mm256_cmpeq_epi8(u, _mm256_set1_epi8('c'))),
+      _mm256_or_si256(_mm256_cmpeq_epi8(u, _mm256_set1_epi8('g')), _mm256_cmpeq_epi8(u, _mm256_set1_epi8('t'))));
+    code = _mm256_or_si256(code, _mm256_andnot_si256(valid, ones));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), code);
+    invalid += 32 - __builtin_popcount(static_cast<uint32_t>(_mm256_movemask_epi8(valid)));
+  }
+  return invalid + encode_scalar(in + i, n - i, out + i);
+}
+
+__attribute__((target("avx2")))
+static void pack_avx2(const uint8_t* bases, int n, uint64_t* words) {
+  /* 4 bases -> 1 byte with two multiply-adds, then the 8 bytes of 32 bases to one word */
+  const __m256i pairs = _mm256_set1_epi16(0x0104), quads = _mm256_set1_epi32(0x00010010);
+  const __m256i gather = _mm256_setr_epi8(
+    0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m256i lanes = _mm256_setr_epi32(0, 4, 1, 1, 1, 1, 1, 1);
+  int j = 0;
+
+  for (; 32 * (j + 1) <= n; j++) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bases + 32 * j));
+    __m256i t = _mm256_madd_epi16(_mm256_maddubs_epi16(v, pairs), quads);
+    t = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(t, gather), lanes);
+    words[j] = __builtin_bswap64(static_cast<uint64_t>(_mm_cvtsi128_si64(_mm256_castsi256_si128(t))));
+  }
+  pack_scalar(bases, n, words, j);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i revcomp_avx2(__m256i x, int k, __m256i mask) {
+  const __m256i bswap = _mm256_setr_epi8(
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+  const __m256i m4 = _mm256_set1_epi8(0x0F), m2 = _mm256_set1_epi8(0x33);
+  x = _mm256_shuffle_epi8(x, bswap);
+  x = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi64(x, 4), m4), _mm256_slli_epi64(_mm256_and_si256(x, m4), 4));
+  x = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi64(x, 2), m2), _mm256_slli_epi64(_mm256_and_si256(x, m2), 2));
+  return _mm256_xor_si256(_mm256_srl_epi64(x, _mm_cvtsi32_si128(64 - 2 * k)), mask);
+}
+
+__attribute__((target("avx2")))
+static void extract_avx2(const uint64_t* words, int nkmers, int k, bool canonical, uint64_t* out) {
+  const __m256i mask = _mm256_set1_epi64x(static_cast<long long>((~0ULL) >> (64 - 2 * k)));
+  const __m256i lane2 = _mm256_setr_epi64x(0, 2, 4, 6), c64 = _mm256_set1_epi64x(64);
+  const __m256i sign = _mm256_set1_epi64x(static_cast<long long>(0x8000000000000000ULL));
+  int i = 0;
+
+  /* the 4 k-mers from i (a multiple of 4) start in the same word j */
+  for (; i + 4 <= nkmers; i += 4) {
+    const int j = i >> 5;
+    __m256i hi = _mm256_set1_epi64x(static_cast<long long>(words[j]));
+    __m256i lo = _mm256_set1_epi64x(static_cast<long long>(words[j + 1]));
+    __m256i s = _mm256_sub_epi64(_mm256_set1_epi64x(128 - 2 * (i & 31) - 2 * k), lane2);
+    // (hi:lo) >> s, shifts by 64 or more give 0
+    __m256i x = _mm256_or_si256(_mm256_or_si256(_mm256_srlv_epi64(lo, s), _mm256_sllv_epi64(hi, _mm256_sub_epi64(c64, s))),
+                                _mm256_srlv_epi64(hi, _mm256_sub_epi64(s, c64)));
+    x = _mm256_and_si256(x, mask);
+    if (canonical) {
+      __m256i rc = revcomp_avx2(x, k, mask);
+      __m256i gt = _mm256_cmpgt_epi64(_mm256_xor_si256(x, sign), _mm256_xor_si256(rc, sign));
+      x = _mm256_blendv_epi8(x, rc, gt);
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), x);
+  }
+  extract_scalar(words, i, nkmers, k, canonical, out);
+}
+
+/* low 64 bits of x * MURMUR_M from three 32-bit multiplies */
+__attribute__((target("avx2")))
+static inline __m256i mul_m_avx2(__m256i x) {
+  const __m256i m_lo = _mm256_set1_epi64x(MURMUR_M & 0xFFFFFFFFULL), m_hi = _mm256_set1_epi64x(MURMUR_M >> 32);
+  __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(x, m_hi), _mm256_mul_epu32(_mm256_srli_epi64(x, 32), m_lo));
+  return _mm256_add_epi64(_mm256_mul_epu32(x, m_lo), _mm256_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i murmur_avx2(__m256i k, __m256i h0) {
+  k = mul_m_avx2(k);
+  k = _mm256_xor_si256(k, _mm256_srli_epi64(k, MURMUR_R));
+  k = mul_m_avx2(k);
+  __m256i h = mul_m_avx2(_mm256_xor_si256(h0, k));
+  h = _mm256_xor_si256(h, _mm256_srli_epi64(h, MURMUR_R));
+  h = mul_m_avx2(h);
+  return _mm256_xor_si256(h, _mm256_srli_epi64(h, MURMUR_R));
+}
+
+/* (hash * npes) >> 64 for npes < 2^32, from the two 32-bit halves of hash */
+__attribute__((target("avx2")))
+static inline __m256i owner_avx2(__m256i h, __m256i npes) {
+  __m256i lo = _mm256_srli_epi64(_mm256_mul_epu32(h, npes), 32);
+  return _mm256_srli_epi64(_mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(h, 32), npes), lo), 32);
+}
+
+__attribute__((target("avx2")))
+static void hash_avx2(const uint64_t* kmers, uint64_t n, uint64_t seed, uint64_t* hashes, int npes, int* owners) {
+  const __m256i h0 = _mm256_set1_epi64x(static_cast<long long>(seed ^ (8 * MURMUR_M)));
+  const __m256i np = _mm256_set1_epi64x(npes), even = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+  uint64_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m256i h = murmur_avx2(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(kmers + i)), h0);
+    if (owners) {
+      __m256i o = _mm256_permutevar8x32_epi32(owner_avx2(h, np), even);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(owners + i), _mm256_castsi256_si128(o));
+    } else {
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(hashes + i), h);
+    }
+  }
+  for (; i < n; i++) {
+    uint64_t h = MurmurHash64A(kmers[i], seed);
+    if (owners) owners[i] = hash_owner(h, npes); else hashes[i] = h;
+  }
+}
+
+// AVX-512 --------------------------------------------------------------------
+__attribute__((target("avx512f,avx512bw")))
+static int encode_avx512(const char* in, int n, uint8_t* out) {
+  const __m512i lut = _mm512_broadcast_i32x4(_mm_setr_epi8(-1, 1, -1, 0, 2, -1, -1, 3, -1, -1, -1, -1, -1, -1, -1, -1));
+  const __m512i nibble = _mm512_set1_epi8(0x0F), lower = _mm512_set1_epi8(0x20), ones = _mm512_set1_epi8(-1);
+  int invalid = 0;
+
+  /* the tail is a masked load and store of the same step */
+  for (int i = 0; i < n; i += 64) {
+    const __mmask64 m = (n - i >= 64) ? ~0ULL : ((1ULL << (n - i)) - 1);
+    __m512i c = _mm512_maskz_loadu_epi8(m, in + i);
+    __m512i code = _mm512_shuffle_epi8(lut, _mm512_and_si512(c, nibble));
+    __m512i u = _mm512_or_si512(c, lower);
+    __mmask64 valid = _mm512_cmpeq_epi8_mask(u, _mm512_set1_epi8('a')) | _mm512_cmpeq_epi8_mask(u, _mm512_set1_epi8('c'))
+                    | _mm512_cmpeq_epi8_mask(u, _mm512_set1_epi8('g')) | _mm512_cmpeq_epi8_mask(u, _mm512_set1_epi8('t'));
+    _mm512_mask_storeu_epi8(out + i, m, _mm512_mask_mov_epi8(ones, valid, code));
+    invalid += __builtin_popcountll(m & ~valid);
+  }
+  return invalid;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void extract_avx512(const uint64_t* words, int nkmers, int k, bool canonical, uint64_t* out) {
+  const __m512i mask = _mm512_set1_epi64(static_cast<long long>((~0ULL) >> (64 - 2 * k)));
+  const __m512i lane2 = _mm512_setr_epi64(0, 2, 4, 6, 8, 10, 12, 14), c64 = _mm512_set1_epi64(64);
+  const __m512i bswap = _mm512_broadcast_i32x4(_mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8));
+  const __m512i m4 = _mm512_set1_epi8(0x0F), m2 = _mm512_set1_epi8(0x33);
+  const __m128i rc_shift = _mm_cvtsi32_si128(64 - 2 * k);
+  int i = 0;
+
+  /* the 8 k-mers from i (a multiple of 8) start in the same word j */
+  for (; i + 8 <= nkmers; i += 8) {
+    const int j = i >> 5;
+    __m512i hi = _mm512_set1_epi64(static_cast<long long>(words[j]));
+    __m512i lo = _mm512_set1_epi64(static_cast<long long>(words[j + 1]));
+    __m512i s = _mm512_sub_epi64(_mm512_set1_epi64(128 - 2 * (i & 31) - 2 * k), lane2);
+    __m512i x = _mm512_or_si512(_mm512_or_si512(_mm512_srlv_epi64(lo, s), _mm512_sllv_epi64(hi, _mm512_sub_epi64(c64, s))),
+                                _mm512_srlv_epi64(hi, _mm512_sub_epi64(s, c64)));
+    x = _mm512_and_si512(x, mask);
+    if (canonical) {
+      __m512i rc = _mm512_shuffle_epi8(x, bswap);
+      rc = _mm512_or_si512(_mm512_and_si512(_mm512_srli_epi64(rc, 4), m4), _mm512_slli_epi64(_mm512_and_si512(rc, m4), 4));
+      rc = _mm512_or_si512(_mm512_and_si512(_mm512_srli_epi64(rc, 2), m2), _mm512_slli_epi64(_mm512_and_si512(rc, m2), 2));
+      rc = _mm512_xor_si512(_mm512_srl_epi64(rc, rc_shift), mask);
+      x = _mm512_min_epu64(x, rc);
+    }
+    _mm512_storeu_si512(out + i, x);
+  }
+  extract_scalar(words, i, nkmers, k, canonical, out);
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static inline __m512i murmur_avx512(__m512i k, __m512i h0) {
+  const __m512i m = _mm512_set1_epi64(static_cast<long long>(MURMUR_M));
+  k = _mm512_mullo_epi64(k, m);
+  k = _mm512_xor_si512(k, _mm512_srli_epi64(k, MURMUR_R));
+  k = _mm512_mullo_epi64(k, m);
+  __m512i h = _mm512_mullo_epi64(_mm512_xor_si512(h0, k), m);
+  h = _mm512_xor_si512(h, _mm512_srli_epi64(h, MURMUR_R));
+  h = _mm512_mullo_epi64(h, m);
+  return _mm512_xor_si512(h, _mm512_srli_epi64(h, MURMUR_R));
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static void hash_avx512(const uint64_t* kmers, uint64_t n, uint64_t seed, uint64_t* hashes, int npes, int* owners) {
+  const __m512i h0 = _mm512_set1_epi64(static_cast<long long>(seed ^ (8 * MURMUR_M)));
+  const __m512i np = _mm512_set1_epi64(npes);
+  uint64_t i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m512i h = murmur_avx512(_mm512_loadu_si512(kmers + i), h0);
+    if (owners) {
+      // (hash * npes) >> 64 for npes < 2^32, from the two 32-bit halves of hash
+      __m512i lo = _mm512_srli_epi64(_mm512_mul_epu32(h, np), 32);
+      __m512i o = _mm512_srli_epi64(_mm512_add_epi64(_mm512_mul_epu32(_mm512_srli_epi64(h, 32), np), lo), 32);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(owners + i), _mm512_cvtepi64_epi32(o));
+    } else {
+      _mm512_storeu_si512(hashes + i, h);
+    }
+  }
+  for (; i < n; i++) {
+    uint64_t h = MurmurHash64A(kmers[i], seed);
+    if (owners) owners[i] = hash_owner(h, npes); else hashes[i] = h;
+  }
+}
+
+// Dispatch -------------------------------------------------------------------
+static simd_level detect_simd_level() {
+  __builtin_cpu_init();
+  if (SIMD_KMERS >= 2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") 
+      && __builtin_cpu_supports("avx512dq")) return SIMD_AVX512;
+  if (SIMD_KMERS >= 1 && __builtin_cpu_supports("avx2")) return SIMD_AVX2;
+  return SIMD_SCALAR;
+}
+
+simd_level simd_kmers_level() {
+  static const simd_level level = detect_simd_level();
+  return level;
+}
+
+const char* simd_kmers_name() {
+  static const char* names[] = {"scalar", "AVX2", "AVX-512"};
+  return names[simd_kmers_level()];
+}
+
+int encode_bases(const char* in, int n, uint8_t* out) {
+  switch (simd_kmers_level()) {
+    case SIMD_AVX512: return encode_avx512(in, n, out);
+    case SIMD_AVX2: return encode_avx2(in, n, out);
+    default: return encode_scalar(in, n, out);
+  }
+}
+
+void get_kmers64(const uint8_t* bases, int n, int k, bool canonical, uint64_t* words, uint64_t* out) {
+  if (n < k) return;
+  const int nkmers = n - k + 1;
+
+  switch (simd_kmers_level()) {
+    case SIMD_AVX512: // every AVX-512 CPU has AVX2
+      pack_avx2(bases, n, words);
+      extract_avx512(words, nkmers, k, canonical, out);
+      break;
+    case SIMD_AVX2:
+      pack_avx2(bases, n, words);
+      extract_avx2(words, nkmers, k, canonical, out);
+      break;
+    default:
+      pack_scalar(bases, n, words, 0);
+      extract_scalar(words, 0, nkmers, k, canonical, out);
+  }
+}
+
+void hash_kmers64(const uint64_t* kmers, uint64_t n, uint64_t seed, uint64_t* hashes) {
+  switch (simd_kmers_level()) {
+    case SIMD_AVX512: hash_avx512(kmers, n, seed, hashes, 0, NULL); break;
+    case SIMD_AVX2: hash_avx2(kmers, n, seed, hashes, 0, NULL); break;
+    default:
+      for (uint64_t i = 0; i < n; i++) hashes[i] = MurmurHash64A(kmers[i], seed);
+  }
+}
+
+void owner_pes64(const uint64_t* kmers, uint64_t n, uint64_t seed, int npes, int* owners) {
+  switch (simd_kmers_level()) {
+    case SIMD_AVX512: hash_avx512(kmers, n, seed, NULL, npes, owners); break;
+    case SIMD_AVX2: hash_avx2(kmers, n, seed, NULL, npes, owners); break;
+    default:
+      for (uint64_t i = 0; i < n; i++) owners[i] = hash_owner(MurmurHash64A(kmers[i], seed), npes);
+  }
+}
@@ -0,0 +1,67 @@
+#ifndef SIMD_KMERS_H
+#define SIMD_KMERS_H
+
+#include <cstdint>
+
+#ifndef SIMD_KMERS
+#define SIMD_KMERS 2 /* widest kernel used if the CPU has it: 0 scalar, 1 AVX2, 2 AVX-512 */
+#endif
+
+enum simd_level {SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512};
+
+/* kernel picked at the first call, from SIMD_KMERS and the running CPU */
+simd_level simd_kmers_level();
+const char* simd_kmers_name();
+
+/*
+ * char2base of in[0, n) into out, 32 (AVX2) or 64 (AVX-512) characters
+ * per step: the low nibble of a letter picks its code with a byte shuffle,
+ * and letters other than A, C, G, T (either case) become 0xFF. Returns the
+ * number of those, so reads without N skip the scan for them.
+ */
+int encode_bases(const char* in, int n, uint8_t* out);
+
+/*
+ * The n - k + 1 k-mers (k <= 32) of bases[0, n), all valid, into out;
+ * min(k-mer, reverse complement) with canonical. The bases are packed 32
+ * per word into words (n / 32 + 2 of them), then every k-mer is cut out
+ * of the two words it spans with lane-wise variable shifts, so the k-mers
+ * of a read are independent of each other instead of a dependent rolling
+ * chain, 4 (AVX2) or 8 (AVX-512) at a time. Without a vector kernel the
+ * rolling k-mer of get_kmers is faster than this.
+ */
+void get_kmers64(const uint8_t* bases, int n, int k, bool canonical, uint64_t* words, uint64_t* out);
+
+/*
+ * PE owning an owner hash: the high half of hash * npes, a multiplication 
+ * where hash % npes takes a division. PE p owns the hashes from 
+ * owner_first_hash(p, npes) up to those of PE p + 1.
+ */
+inline int hash_owner(uint64_t hash, int npes) {
+  return static_cast<int>((static_cast<__uint128_t>(hash) * static_cast<uint64_t>(npes)) >> 64);
+}
+
+inline uint64_t owner_first_hash(int p, int npes) {
+  return static_cast<uint64_t>(((static_cast<__uint128_t>(p) << 64) + npes - 1) / npes);
+}
+
+/*
+ * Round of -R counting an owner hash: which of rounds equal slices of 
+ * its owner's range it falls into, the low half of hash * npes scaled 
+ * like hash_owner. Equal to hash_owner(hash, npes * rounds) % rounds.
+ */
+inline int hash_round(uint64_t hash, int npes, int rounds) {
+  return hash_owner(hash * static_cast<uint64_t>(npes), rounds);
+}
+
+/*
+ * MurmurHash64A(kmers[i], seed) of n 64-bit k-mers into hashes, and with 
+ * owner_pes64 their hash_owner in npes, 4 (AVX2) or 8 (AVX-512) k-mers at 
+ * a time with vector 64-bit multiplies (built from 32-bit ones on AVX2), 
+ * so a flush hashes at the speed of its buffer instead of one dependent 
+ * multiply chain per k-mer. hashes may be kmers.
+ */
+void hash_kmers64(const uint64_t* kmers, uint64_t n, uint64_t seed, uint64_t* hashes);
+void owner_pes64(const uint64_t* kmers, uint64_t n, uint64_t seed, int npes, int* owners);
+
+#endif
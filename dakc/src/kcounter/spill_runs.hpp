@@ -0,0 +1,138 @@
+#ifndef SPILL_RUNS_H
+#define SPILL_RUNS_H
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <queue>
+#include <iostream>
+#include <unistd.h>
+
+#include <mpi.h>
+
+#ifndef SPILL_BUFFER
+#define SPILL_BUFFER (1 << 16) /* (k-mer, count) records written or read per run at once */
+#endif
+
+/*
+ * Sorted (k-mer, count) runs a PE spills to files in a scratch directory
+ * (--mem-limit). put() appends to the run opened by begin(), in increasing
+ * k-mer order. merge() reads all the runs back at once, SPILL_BUFFER
+ * records of each at a time, and adds up the counts of equal k-mers in
+ * one k-way merge over a heap of the runs' current records, then removes
+ * the files. record is a kmer_packet.
+ */
+template<typename record>
+class spill_runs {
+public:
+  uint64_t limit; // bytes of received k-mers a PE holds before it spills a run
+  uint64_t records = 0; // written over all runs
+
+  spill_runs(uint64_t limit, const std::string &dir, int rank)
+    : limit(limit), prefix(dir + "/dakc." + std::to_string(getpid()) + "." + std::to_string(rank) + ".") {
+    buf.reserve(SPILL_BUFFER);
+  }
+
+  ~spill_runs() {
+    if (file) fclose(file);
+    for (const std::string &path : paths) remove(path.c_str());
+  }
+
+  size_t runs() const { return paths.size(); }
+  uint64_t bytes() const { return records * sizeof(record); }
+
+  void begin() {
+    paths.push_back(prefix + std::to_string(paths.size()));
+    file = fopen(paths.back().c_str(), "wb");
+    if (!file) fail("create", paths.back());
+  }
+
+  inline void put(const record &r) {
+    buf.push_back(r);
+    if (__builtin_expect(buf.size() == SPILL_BUFFER, 0)) write_buf();
+  }
+
+  void end() {
+    write_buf();
+    if (fclose(file) != 0) fail("write", paths.back());
+    file = NULL;
+  }
+
+  /* calls emit(record) for every distinct k-mer of the runs, in order */
+  template<typename emit_fn>
+  void merge(emit_fn emit) {
+    std::vector<run_reader> in(paths.size());
+    for (size_t r = 0; r < in.size(); r++) {
+      in[r].file = fopen(paths[r].c_str(), "rb");
+      if (!in[r].file) fail("open", paths[r]);
+      in[r].buf.resize(SPILL_BUFFER);
+    }
+
+    /* the run with the smallest current k-mer on top */
+    auto later = [&in](size_t a, size_t b) { return in[b].head().kmer < in[a].head().kmer; };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heap(later);
+    for (size_t r = 0; r < in.size(); r++) {
+      if (in[r].next()) heap.push(r);
+    }
+
+    record cur;
+    bool have = false;
+    while (!heap.empty()) {
+      const size_t r = heap.top();
+      heap.pop();
+      const record &x = in[r].head();
+      if (have && x.kmer == cur.kmer) {
+        cur.count += x.count;
+      } else {
+        if (have) emit(cur);
+        cur = x;
+        have = true;
+      }
+      in[r].pos++;
+      if (in[r].next()) heap.push(r);
+    }
+    if (have) emit(cur);
+
+    for (size_t r = 0; r < in.size(); r++) {
+      fclose(in[r].file);
+      remove(paths[r].c_str());
+    }
+    paths.clear();
+  }
+
+private:
+  struct run_reader {
+    FILE* file = NULL;
+    std::vector<record> buf;
+    size_t pos = 0, end = 0;
+
+    const record& head() const { return buf[pos]; }
+
+    /* false once the run is read */
+    bool next() {
+      if (pos < end) return true;
+      pos = 0;
+      end = fread(buf.data(), sizeof(record), buf.size(), file);
+      return end > 0;
+    }
+  };
+
+  std::string prefix;
+  std::vector<std::string> paths;
+  std::vector<record> buf;
+  FILE* file = NULL;
+
+  void write_buf() {
+    if (fwrite(buf.data(), sizeof(record), buf.size(), file) != buf.size()) fail("write", paths.back());
+    records += buf.size();
+    buf.clear();
+  }
+
+  void fail(const char* what, const std::string &path) const {
+    std::cout << "Could not " << what << " the spilled run " << path << std::endl;
+    MPI_Abort(MPI_COMM_WORLD, 2);
+  }
+};
+
+#endif
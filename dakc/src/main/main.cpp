@@ -17,6 +17,7 @@
 #include "common.hpp"
 #include "fqreader.hpp"
 #include "kcounter.hpp"
+#include "autotune.hpp"
 
 int main(int argc, char** argv) {
     // initialize the MPI runtime 
@@ -36,17 +37,25 @@ int main(int argc, char** argv) {
 
         shmem_barrier_all();
         std::unordered_map<kmer_t, count_t> dbg; // Is there any use for this anymore ??
-        std::vector<kmer_t> vectordbg;
         
         // read the fasta/q files (kernel 1, part 1)
-        fqreader fq(arg.file_name, READLEN, rank, size);
-        char* read_chunk = fq.read_file();
+        // the input is streamed in windows while the k-mers are counted
+        fqreader fq(arg.file_name, rank, size);
+        fq.open_stream(arg.window_size, arg.cfg.kmer_len);
+
+        // pick C2, C3 and HITTER for this machine and input
+        kcount_config cfg = arg.cfg;
+        if (arg.autotune) autotune(fq, cfg);
+
+        // estimate the (distinct) k-mers to presize the tables and pick -r
+        if (arg.estimate) estimate_kmers(fq, cfg, !arg.receiver_given);
         
         // time to perform k-mer counting 
-        kmercounter km(read_chunk, vectordbg);
+        bool counted = count_kmers(fq, cfg);
+        if (!counted) MPI_Abort(MPI_COMM_WORLD, 1);
         
         // free the variables
-        free(read_chunk);
+        fq.close_stream();
     });
 
     // finalize shmem
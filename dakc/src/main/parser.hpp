@@ -4,6 +4,7 @@
 #include <iostream>
 #include <string>
 #include <assert.h>
+#include <cstdlib>
 
 #include <mpi.h>
 #include <getopt.h> // for argument parsing
@@ -14,6 +15,28 @@
 option longopts[] { 
   {"help", no_argument, NULL, 'h'},
   {"file", required_argument, NULL, 'f'}, 
+  {"kmer", required_argument, NULL, 'k'},
+  {"bucket", required_argument, NULL, 'b'},
+  {"pktsize", required_argument, NULL, 'c'},
+  {"canonical", no_argument, NULL, 'C'},
+  {"window", required_argument, NULL, 'w'},
+  {"output", required_argument, NULL, 'o'},
+  {"query", required_argument, NULL, 'q'},
+  {"min-count", required_argument, NULL, 'm'},
+  {"max-count", required_argument, NULL, 'x'},
+  {"solid", no_argument, NULL, 's'},
+  {"hist", required_argument, NULL, 'H'},
+  {"hitter", required_argument, NULL, 'l'},
+  {"autotune", no_argument, NULL, 'a'},
+  {"estimate", no_argument, NULL, 'e'},
+  {"minimizer", no_argument, NULL, 'M'},
+  {"delta", no_argument, NULL, 'd'},
+  {"threads", required_argument, NULL, 't'},
+  {"node-agg", no_argument, NULL, 'n'},
+  {"receiver", required_argument, NULL, 'r'},
+  {"mem-limit", required_argument, NULL, 'L'},
+  {"spill-dir", required_argument, NULL, 'D'},
+  {"rounds", required_argument, NULL, 'R'},
   {0}
 };
 
@@ -21,6 +44,11 @@ class arg_parser {
 public:
   // arguments of the program
   std::string     file_name = "0";
+  uint64_t        window_size = INPUT_WINDOW_SIZE;
+  bool            autotune = false;
+  bool            estimate = false;
+  bool            receiver_given = false;
+  kcount_config   cfg;
 
   // description of al supported options
   void print_usage();
@@ -36,7 +64,7 @@ public:
     bool help_flag = false;
     int opt;
 
-    while((opt = getopt_long(argc, argv, "hp:f:g:r:k:b:m:x:z:y:", longopts, 0)) != -1) { 
+    while((opt = getopt_long(argc, argv, "hCsaeMdnp:f:g:k:b:c:w:o:q:m:x:H:l:t:r:L:D:R:z:y:", longopts, 0)) != -1) { 
       
       switch (opt) { 
         case 'h':
@@ -45,6 +73,80 @@ public:
         case 'f':
           this->file_name.assign(optarg);
           break;
+        case 'k':
+          this->cfg.kmer_len = atoi(optarg);
+          break;
+        case 'b':
+          this->cfg.bucket_size = strtoull(optarg, NULL, 10);
+          break;
+        case 'c':
+          this->cfg.pkt_size = atoi(optarg);
+          break;
+        case 'C':
+          this->cfg.canonical = true;
+          break;
+        case 'w':
+          this->window_size = strtoull(optarg, NULL, 10);
+          break;
+        case 'o':
+          this->cfg.output_file.assign(optarg);
+          break;
+        case 'q':
+          this->cfg.query_file.assign(optarg);
+          break;
+        case 'm':
+          this->cfg.min_count = strtoull(optarg, NULL, 10);
+          break;
+        case 'x':
+          this->cfg.max_count = strtoull(optarg, NULL, 10);
+          break;
+        case 's':
+          this->cfg.solid = true;
+          break;
+        case 'H':
+          this->cfg.hist_file.assign(optarg);
+          break;
+        case 'l':
+          this->cfg.hitter = (atoi(optarg) != 0);
+          break;
+        case 'a':
+          this->autotune = true;
+          break;
+        case 'e':
+          this->estimate = true;
+          break;
+        case 'M':
+          this->cfg.minimizer = true;
+          break;
+        case 'd':
+          this->cfg.codec = true;
+          break;
+        case 't':
+          this->cfg.threads = atoi(optarg);
+          break;
+        case 'n':
+          this->cfg.node_agg = true;
+          break;
+        case 'r':
+          this->receiver_given = true;
+          if (std::string(optarg) == "hash") {
+            this->cfg.receiver = RECV_HASH;
+          } else if (std::string(optarg) == "sort") {
+            this->cfg.receiver = RECV_SORT;
+          } else {
+            print_usage();
+            assert(0 && "--receiver is sort or hash");
+          }
+          break;
+        case 'L':
+          this->cfg.mem_limit = strtoull(optarg, NULL, 10) << 20;
+          break;
+        case 'D':
+          this->cfg.spill_dir.assign(optarg);
+          break;
+        case 'R':
+          this->cfg.rounds = atoi(optarg);
+          break;
         default:
           print_usage();
           assert(0 && "Should not reach here !!");
@@ -59,22 +161,81 @@ inline void arg_parser::print_usage() {
   std::cout << "required program parameters:" << std::endl;
   std::cout << "-h, --help\t" << "Print this help and exit" << std::endl;
   std::cout << "-f, --file1\t" << "file name" << std::endl;
+  std::cout << "optional program parameters:" << std::endl;
+  std::cout << "-k, --kmer\t" << "k-mer length (default " << KMERLEN << ")" << std::endl;
+  std::cout << "-b, --bucket\t" << "C3, k-mers parsed before each flush (default " << KCOUNT_BUCKET_SIZE << ")" << std::endl;
+  std::cout << "-c, --pktsize\t" << "BIGKSIZE, C2 = 2 x BIGKSIZE (default " << BIGKSIZE << ")" << std::endl;
+  std::cout << "-C, --canonical\t" << "count canonical (strand independent) k-mers" << std::endl;
+  std::cout << "-w, --window\t" << "bytes of input read per window (default " << INPUT_WINDOW_SIZE << ")" << std::endl;
+  std::cout << "-o, --output\t" << "write the k-mer counts to this binary table (.ktab)" << std::endl;
+  std::cout << "-q, --query\t" << "answer the k-mer queries in this file (one per line) into <file>.counts," << std::endl;
+  std::cout << "\t\t" << "'-' stays resident and reads query file names from stdin" << std::endl;
+  std::cout << "-m, --min-count\t" << "drop k-mers counted fewer times (default " << MIN_KMER_COUNT << ")" << std::endl;
+  std::cout << "-x, --max-count\t" << "drop k-mers counted more times (default " << MAX_KMER_COUNT << ")" << std::endl;
+  std::cout << "-s, --solid\t" << "pick the minimum count at the error/solid valley of the k-mer spectrum" << std::endl;
+  std::cout << "-H, --hist\t" << "write the k-mer spectrum (count, number of k-mers) to this file" << std::endl;
+  std::cout << "-l, --hitter\t" << "1: aggregate the repeats of a C3 buffer (L3), 0: send every k-mer (default " << HITTER << ")" << std::endl;
+  std::cout << "-M, --minimizer\t" << "own k-mers by their minimizer (m = " << MINIMIZERLEN << ") and send packed super-k-mers" << std::endl;
+  std::cout << "-d, --delta\t" << "send sorted, delta and Rice coded packets (k <= 32)" << std::endl;
+  std::cout << "-t, --threads\t" << "threads parsing and sorting the reads of every PE (default " << KCOUNT_THREADS << ")" << std::endl;
+  std::cout << "-n, --node-agg\t" << "combine the k-mers of a node into (k-mer, count) runs before they cross the network" << std::endl;
+  std::cout << "-r, --receiver\t" << "sort: keep every received copy and sort at the end (default), hash: count on receipt" << std::endl;
+  std::cout << "-L, --mem-limit\t" << "MB of received k-mers a PE holds, beyond that sorted runs are spilled to disk (default: no limit)" << std::endl;
+  std::cout << "-D, --spill-dir\t" << "node-local directory of the spilled runs (default " << SPILL_DIR << ")" << std::endl;
+  std::cout << "-R, --rounds\t" << "count in this many passes over the input, each receiving 1/R of the k-mers (default " << KCOUNT_ROUNDS << ")" << std::endl;
+  std::cout << "-a, --autotune\t" << "measure the machine and the input at startup and pick C2, C3 and --hitter" << std::endl;
+  std::cout << "-e, --estimate\t" << "estimate the k-mers and distinct k-mers from a sample to presize the tables and pick -r" << std::endl;
 }
 
 inline void arg_parser::arg_parser_sanity_check() { 
   // Must provide file name
   assert(this->file_name != "0");
+  assert(this->cfg.kmer_len > 0 && this->cfg.kmer_len <= 128);
+  assert(this->cfg.bucket_size > 0);
+  assert(this->cfg.threads > 0);
+  assert(this->cfg.rounds > 0);
+  assert(this->window_size > 0);
+  assert(this->cfg.min_count <= this->cfg.max_count);
 }
 
 inline void arg_parser::print_params() {
   std::cout << "File Name : " << this->file_name << std::endl; 
-  std::cout << "Read Length : " << READLEN << std::endl;
-  std::cout << "k-mer Length : " << KMERLEN << std::endl;
-  std::cout << "C3 Length : " << KCOUNT_BUCKET_SIZE << std::endl;
-  std::cout << "C2 Length : " << BIGKSIZE * 2 << std::endl;
-  // std::cout << "minimizer_length = " << MINIMIZERLEN << std::endl;
-  // std::cout << "maximum kmer count = " << MAX_KMER_COUNT << std::endl; 
-  // std::cout << "min kmer count = " << MIN_KMER_COUNT << std::endl;
+  std::cout << "k-mer Length : " << this->cfg.kmer_len << std::endl;
+  std::cout << "C3 Length : " << this->cfg.bucket_size << std::endl;
+  std::cout << "C2 Length : " << this->cfg.pkt_size * 2 << std::endl;
+  std::cout << "Canonical : " << (this->cfg.canonical ? "yes" : "no") << std::endl;
+  if (this->autotune)
+    std::cout << "C2, C3, HITTER : autotuned" << std::endl;
+  else
+    std::cout << "HITTER : " << (this->cfg.hitter ? "on" : "off") << std::endl;
+  if (this->cfg.threads > 1)
+    std::cout << "Threads per PE : " << this->cfg.threads << std::endl;
+  if (this->cfg.node_agg)
+    std::cout << "Node Aggregation : yes" << std::endl;
+  if (this->cfg.receiver == RECV_HASH)
+    std::cout << "Receiver Backend : hash table" << std::endl;
+  else if (this->estimate)
+    std::cout << "Receiver Backend : from the estimate" << std::endl;
+  if (this->cfg.rounds > 1)
+    std::cout << "Counting Rounds : " << this->cfg.rounds << std::endl;
+  if (this->cfg.mem_limit)
+    std::cout << "Memory Limit : " << (this->cfg.mem_limit >> 20) << " MB, runs in " << this->cfg.spill_dir << std::endl;
+  std::cout << "Input Window : " << this->window_size << std::endl;
+  if (!this->cfg.output_file.empty())
+    std::cout << "Output File : " << this->cfg.output_file << std::endl;
+  if (!this->cfg.query_file.empty())
+    std::cout << "Query File : " << (this->cfg.query_file == "-" ? "names from stdin" : this->cfg.query_file) << std::endl;
+  if (this->cfg.solid)
+    std::cout << "Min k-mer Count : solid threshold" << std::endl;
+  else
+    std::cout << "Min k-mer Count : " << this->cfg.min_count << std::endl;
+  std::cout << "Max k-mer Count : " << this->cfg.max_count << std::endl;
+  if (!this->cfg.hist_file.empty())
+    std::cout << "Histogram File : " << this->cfg.hist_file << std::endl;
+  if (this->cfg.minimizer)
+    std::cout << "Minimizer Length : " << MINIMIZERLEN << std::endl;
+  if (this->cfg.codec)
+    std::cout << "Coded Packets : yes" << std::endl;
   // std::cout << "min contig len = " << MINCONTIGLEN << std::endl;
 }
 
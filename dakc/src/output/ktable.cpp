@@ -0,0 +1,175 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include <mpi.h>
+
+#include "ktable.hpp"
+
+#define MAX_WRITE_COUNT (1 << 30) /* MPI counts are ints, write in 1GB pieces */
+
+/* the table is little endian, like the machines DAKC runs on */
+static inline void put_bytes(std::vector<uint8_t> &buf, const void* src, size_t len) {
+  const uint8_t* p = static_cast<const uint8_t*>(src);
+  buf.insert(buf.end(), p, p + len);
+}
+
+static inline void put_u32(std::vector<uint8_t> &buf, uint32_t v) { put_bytes(buf, &v, sizeof(v)); }
+static inline void put_u64(std::vector<uint8_t> &buf, uint64_t v) { put_bytes(buf, &v, sizeof(v)); }
+
+ktable_writer::ktable_writer(int kmer_len, int key_words, bool canonical, uint64_t owner_seed, int minimizer_len)
+  : kmer_len(kmer_len), key_words(key_words), canonical(canonical), owner_seed(owner_seed), minimizer_len(minimizer_len),
+    prev_key(key_words, 0), min_key(key_words, 0), max_key(key_words, 0), delta(key_words, 0) {}
+
+void ktable_writer::put_varint(uint64_t v) {
+  while (v >= 0x80) {
+    payload.push_back(static_cast<uint8_t>(v) | 0x80);
+    v >>= 7;
+  }
+  payload.push_back(static_cast<uint8_t>(v));
+}
+
+void ktable_writer::put_key_delta(const uint64_t* key) {
+  if (key_words == 1) {
+    put_varint(key[0] - prev_key[0]);
+    return;
+  }
+
+  /* multi-word subtraction, then LEB128 over the whole difference */
+  uint64_t borrow = 0;
+  for (int i = key_words - 1; i >= 0; i--) {
+    uint64_t d = key[i] - prev_key[i] - borrow;
+    borrow = (key[i] < prev_key[i] || (key[i] == prev_key[i] && borrow)) ? 1 : 0;
+    delta[i] = d;
+  }
+
+  int top = 0;
+  while (top < key_words - 1 && delta[top] == 0) top++;
+
+  while (true) {
+    uint8_t byte = delta[key_words - 1] & 0x7F;
+    for (int i = key_words - 1; i >= top; i--) {
+      delta[i] >>= 7;
+      if (i > top) delta[i] |= delta[i - 1] << 57;
+    }
+    while (top < key_words - 1 && delta[top] == 0) top++;
+
+    bool more = (delta[top] != 0);
+    payload.push_back(more ? (byte | 0x80) : byte);
+    if (!more) break;
+  }
+}
+
+void ktable_writer::add(const uint64_t* key, count_t count) {
+  if (entries % KTABLE_CHECKPOINT == 0) {
+    checkpoints.insert(checkpoints.end(), key, key + key_words);
+    checkpoints.push_back(payload.size());
+  } else {
+    put_key_delta(key);
+  }
+  put_varint(count);
+
+  if (entries == 0) std::copy(key, key + key_words, min_key.begin());
+  std::copy(key, key + key_words, max_key.begin());
+  std::copy(key, key + key_words, prev_key.begin());
+
+  entries++;
+  total_count += count;
+}
+
+uint64_t ktable_writer::write(const std::string &filename) {
+  int rank, npes;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &npes);
+
+  /* this PE's section: header, checkpoint table and payload */
+  std::vector<uint8_t> section;
+  uint64_t ncheckpoints = checkpoints.size() / (key_words + 1);
+
+  section.reserve(48 + 16 * key_words + checkpoints.size() * 8 + payload.size());
+  put_bytes(section, "DAKCSECT", 8);
+  put_u32(section, rank);
+  put_u32(section, npes);
+  put_u64(section, entries);
+  put_u64(section, total_count);
+  put_u64(section, ncheckpoints);
+  put_u64(section, payload.size());
+  for (int i = 0; i < key_words; i++) put_u64(section, min_key[i]);
+  for (int i = 0; i < key_words; i++) put_u64(section, max_key[i]);
+  for (uint64_t v : checkpoints) put_u64(section, v);
+  put_bytes(section, payload.data(), payload.size());
+  std::vector<uint8_t>().swap(payload);
+
+  /* sections are laid out in PE order after the file header */
+  uint64_t section_bytes = section.size(), section_offset = 0;
+  uint64_t local[3] = {section_bytes, entries, total_count}, global[3];
+
+  MPI_Exscan(&section_bytes, &section_offset, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+  if (rank == 0) section_offset = 0;
+  section_offset += KTABLE_HEADER_SIZE;
+  MPI_Allreduce(local, global, 3, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+  uint64_t index_offset = KTABLE_HEADER_SIZE + global[0];
+
+  if (rank == 0) MPI_File_delete(filename.c_str(), MPI_INFO_NULL);
+  MPI_Barrier(MPI_COMM_WORLD);
+
+  MPI_File file;
+  int ierr = MPI_File_open(MPI_COMM_WORLD, filename.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                           MPI_INFO_NULL, &file);
+  if (ierr) {
+    if (rank == 0) std::cout << "Could not create the k-mer table " << filename << std::endl;
+    MPI_Abort(MPI_COMM_WORLD, 2);
+  }
+
+  /* collective writes, every PE takes part in the same number of rounds */
+  uint64_t rounds = (section_bytes + MAX_WRITE_COUNT - 1) / MAX_WRITE_COUNT, max_rounds;
+  MPI_Allreduce(&rounds, &max_rounds, 1, MPI_UINT64_T, MPI_MAX, MPI_COMM_WORLD);
+  for (uint64_t r = 0; r < max_rounds; r++) {
+    uint64_t done = std::min<uint64_t>(r * MAX_WRITE_COUNT, section_bytes);
+    int count = static_cast<int>(std::min<uint64_t>(MAX_WRITE_COUNT, section_bytes - done));
+    MPI_File_write_at_all(file, section_offset + done, section.data() + done, count,
+                          MPI_BYTE, MPI_STATUS_IGNORE);
+  }
+
+  /* index footer, assembled on PE 0 */
+  std::vector<uint64_t> index_entry = {section_offset, section_bytes, entries};
+  index_entry.insert(index_entry.end(), min_key.begin(), min_key.end());
+  index_entry.insert(index_entry.end(), max_key.begin(), max_key.end());
+
+  std::vector<uint64_t> index(rank == 0 ? index_entry.size() * npes : 0);
+  MPI_Gather(index_entry.data(), index_entry.size(), MPI_UINT64_T,
+             index.data(), index_entry.size(), MPI_UINT64_T, 0, MPI_COMM_WORLD);
+
+  uint64_t file_bytes = index_offset + (index_entry.size() * npes + 2) * 8 + 8;
+
+  if (rank == 0) {
+    std::vector<uint8_t> header, footer;
+
+    put_bytes(header, "DAKCKTAB", 8);
+    put_u32(header, KTABLE_VERSION);
+    put_u32(header, kmer_len);
+    put_u32(header, key_words);
+    put_u32(header, npes);
+    put_u32(header, canonical ? 1 : 0);
+    put_u32(header, KTABLE_CHECKPOINT);
+    put_u32(header, minimizer_len > 0 ? 2 : 1);
+    put_u32(header, minimizer_len);
+    put_u64(header, owner_seed);
+    put_u64(header, global[1]);
+    put_u64(header, global[2]);
+    put_u64(header, index_offset);
+
+    for (uint64_t v : index) put_u64(footer, v);
+    put_u64(footer, npes);
+    put_u64(footer, index_offset);
+    put_bytes(footer, "DAKCKEND", 8);
+
+    MPI_File_write_at(file, 0, header.data(), header.size(), MPI_BYTE, MPI_STATUS_IGNORE);
+    MPI_File_write_at(file, index_offset, footer.data(), footer.size(), MPI_BYTE, MPI_STATUS_IGNORE);
+  }
+
+  MPI_File_close(&file);
+  return file_bytes;
+}
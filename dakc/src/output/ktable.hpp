@@ -0,0 +1,79 @@
+#ifndef KTABLE_H
+#define KTABLE_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cinttypes>
+
+#include <mpi.h>
+
+#include "common.hpp"
+
+/*
+ * Binary k-mer count table (.ktab), written collectively by all PEs into a
+ * single file. All integers are little endian. A key is a k-mer in the
+ * 2-bit encoding of char2base, stored as key_words 64-bit words, most
+ * significant word first.
+ *
+ *   file header   (KTABLE_HEADER_SIZE bytes, PE 0)
+ *     char[8]  magic "DAKCKTAB"
+ *     uint32   version, kmer_len, key_words, npes
+ *     uint32   canonical, checkpoint (entries per checkpoint block)
+ *     uint32   owner_hash (1: MurmurHash64A chained over the key words,
+ *                          2: MurmurHash64A of the minimizer)
+ *     uint32   minimizer_len (m of owner_hash 2, else 0)
+ *     uint64   owner_seed, total_entries, total_count, index_offset
+ *   one section per PE, in PE order
+ *     section header
+ *       char[8]  magic "DAKCSECT"
+ *       uint32   pe, npes
+ *       uint64   entries, total_count, ncheckpoints, payload_bytes
+ *       uint64   min_key[key_words], max_key[key_words]
+ *     checkpoint table, one per block of `checkpoint` entries
+ *       uint64   key[key_words], payload_offset
+ *     payload, entries in increasing key order
+ *       the first entry of a block: varint count (its key is the checkpoint key)
+ *       other entries:              varint (key - previous key), varint count
+ *   index footer (PE 0)
+ *     per PE: uint64 section_offset, section_bytes, entries,
+ *             min_key[key_words], max_key[key_words]
+ *     uint64   npes, index_offset
+ *     char[8]  magic "DAKCKEND"
+ *
+ * Varints are LEB128 (7 bits per byte, low bits first); a key delta is the
+ * multi-word difference encoded the same way. A reader can mmap the file,
+ * find the footer from its last 24 bytes, pick sections by key range,
+ * binary search the checkpoint keys and decode at most one block.
+ */
+#define KTABLE_HEADER_SIZE 72
+#define KTABLE_CHECKPOINT  256
+#define KTABLE_VERSION     1
+
+class ktable_writer {
+public:
+  // minimizer_len > 0: k-mers are owned by the PE of their minimizer of that length
+  ktable_writer(int kmer_len, int key_words, bool canonical, uint64_t owner_seed, int minimizer_len = 0);
+
+  // keys must be added in increasing order
+  void add(const uint64_t* key, count_t count);
+
+  // collective, returns the number of bytes in the file
+  uint64_t write(const std::string &filename);
+
+private:
+  int kmer_len, key_words;
+  bool canonical;
+  uint64_t owner_seed;
+  int minimizer_len;
+
+  uint64_t entries = 0, total_count = 0;
+  std::vector<uint64_t> prev_key, min_key, max_key, delta;
+  std::vector<uint64_t> checkpoints; // key words followed by the payload offset
+  std::vector<uint8_t> payload;
+
+  void put_varint(uint64_t v);
+  void put_key_delta(const uint64_t* key);
+};
+
+#endif
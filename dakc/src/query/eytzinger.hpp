@@ -0,0 +1,80 @@
+#ifndef EYTZINGER_H
+#define EYTZINGER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+/* entries of the sorted array covered by one index key */
+#ifndef EYTZINGER_BLOCK
+#define EYTZINGER_BLOCK 16
+#endif
+
+/*
+ * Search index over a sorted array of records. The first key of every
+ * block of EYTZINGER_BLOCK records is stored in Eytzinger (BFS) order, so
+ * the top levels of the search tree share a few cache lines and the
+ * descent is branch free and prefetched a few levels ahead. A lookup walks
+ * the tree to the one block that can hold the key and scans that block in
+ * the sorted array itself; the array is not copied.
+ */
+template<typename key_type>
+class eytzinger_index {
+public:
+  template<typename T, typename key_fn>
+  void build(const T* sorted, size_t n, key_fn key_of) {
+    size_t nblocks = (n + EYTZINGER_BLOCK - 1) / EYTZINGER_BLOCK;
+    size_t next = 0;
+
+    this->n = n;
+    tree.resize(nblocks + 1);
+    block.resize(nblocks + 1);
+    fill(sorted, key_of, 1, next);
+  }
+
+  /* position of key in the sorted array, or -1 if it is not there */
+  template<typename T, typename key_fn>
+  int64_t find(const T* sorted, const key_type &key, key_fn key_of) const {
+    const size_t nblocks = tree.size() - 1;
+    if (nblocks == 0) return -1;
+
+    /* first block head greater than the key */
+    size_t i = 1;
+    while (i <= nblocks) {
+      __builtin_prefetch(tree.data() + PREFETCH_STRIDE * i);
+      i = 2 * i + !(key < tree[i]);
+    }
+    i >>= __builtin_ffsll(~i);
+
+    size_t b = (i == 0) ? nblocks : block[i];
+    if (b == 0) return -1; // smaller than every key
+
+    size_t lo = (b - 1) * EYTZINGER_BLOCK;
+    size_t hi = std::min(lo + EYTZINGER_BLOCK, n);
+    for (size_t j = lo; j < hi; j++) {
+      if (key_of(sorted[j]) == key) return j;
+    }
+    return -1;
+  }
+
+private:
+  /* the descendants of node i, log2(stride) levels down, share the line at stride * i */
+  static constexpr size_t PREFETCH_STRIDE = (sizeof(key_type) >= 64) ? 1 : 64 / sizeof(key_type);
+
+  size_t n = 0;
+  std::vector<key_type> tree; // block heads, 1-based Eytzinger order
+  std::vector<size_t> block;  // block number of tree[i]
+
+  template<typename T, typename key_fn>
+  void fill(const T* sorted, key_fn key_of, size_t i, size_t &next) {
+    if (i >= tree.size()) return;
+    fill(sorted, key_of, 2 * i, next);
+    tree[i] = key_of(sorted[next * EYTZINGER_BLOCK]);
+    block[i] = next;
+    next++;
+    fill(sorted, key_of, 2 * i + 1, next);
+  }
+};
+
+#endif
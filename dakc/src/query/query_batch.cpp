@@ -0,0 +1,141 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include <mpi.h>
+
+#include "query_batch.hpp"
+
+#define PROBE_SIZE (1 << 12)
+#define MAX_ROUND_SIZE (1ULL << 28) /* keeps the text of a round's counts below INT_MAX bytes */
+
+query_batch::query_batch(const std::string &filename, uint64_t round_size) {
+  this->filename = filename;
+  this->out_filename = filename + ".counts";
+  this->round_size = std::max<uint64_t>(1, std::min<uint64_t>(round_size, MAX_ROUND_SIZE));
+}
+
+MPI_Offset query_batch::find_line_start(MPI_Offset from, MPI_Offset filesize) {
+/*
+ * Offset of the first line starting at or after 'from'. The probe starts
+ * one byte early so that a line starting exactly at 'from' is kept.
+ */
+  if (from <= 0) return 0;
+  if (from >= filesize) return filesize;
+
+  char probe[PROBE_SIZE];
+  MPI_Offset at = from - 1;
+
+  while (at < filesize) {
+    int count = static_cast<int>(std::min<MPI_Offset>(PROBE_SIZE, filesize - at));
+    MPI_File_read_at(inputfile, at, probe, count, MPI_CHAR, MPI_STATUS_IGNORE);
+
+    const char* nl = static_cast<const char*>(memchr(probe, '\n', count));
+    if (nl != NULL) return at + (nl - probe) + 1;
+    at += count;
+  }
+  return filesize;
+}
+
+bool query_batch::open() {
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &npes);
+
+  int ierr = MPI_File_open(MPI_COMM_WORLD, filename.c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &inputfile);
+  if (ierr) {
+    if (rank == 0) std::cout << "Couldn't open the query file " << filename << std::endl;
+    return false;
+  }
+  MPI_File_get_size(inputfile, &filesize);
+
+  if (rank == 0) MPI_File_delete(out_filename.c_str(), MPI_INFO_NULL);
+  MPI_Barrier(MPI_COMM_WORLD);
+
+  ierr = MPI_File_open(MPI_COMM_WORLD, out_filename.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                       MPI_INFO_NULL, &outputfile);
+  if (ierr) {
+    if (rank == 0) std::cout << "Couldn't create " << out_filename << std::endl;
+    MPI_File_close(&inputfile);
+    return false;
+  }
+  return true;
+}
+
+bool query_batch::next_round(const char* &data, uint64_t &len) {
+  if (round_start >= filesize) return false;
+
+  /* the lines starting in this PE's slice, a line longer than a slice 
+     leaves the next PEs empty-handed */
+  MPI_Offset slice = static_cast<MPI_Offset>(round_size);
+  MPI_Offset start = find_line_start(round_start + slice * rank, filesize);
+  MPI_Offset end = find_line_start(round_start + slice * (rank + 1), filesize);
+  round_start += slice * npes;
+
+  len = end - start;
+  buf.resize(len);
+  for (uint64_t done = 0; done < len; ) {
+    int count = static_cast<int>(std::min<uint64_t>(len - done, MAX_ROUND_SIZE));
+    MPI_File_read_at(inputfile, start + done, buf.data() + done, count, MPI_CHAR, MPI_STATUS_IGNORE);
+    done += count;
+  }
+
+  data = buf.data();
+  return true;
+}
+
+void query_batch::write_counts(const std::vector<count_t> &counts) {
+  out.clear();
+  for (count_t count : counts) {
+    out += std::to_string(count);
+    out += '\n';
+  }
+  numqueries += counts.size();
+
+  uint64_t bytes = out.size(), offset = 0, total = 0;
+  MPI_Exscan(&bytes, &offset, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+  if (rank == 0) offset = 0;
+  MPI_Allreduce(&bytes, &total, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+
+  MPI_File_write_at_all(outputfile, out_offset + offset, out.data(), static_cast<int>(bytes),
+                        MPI_CHAR, MPI_STATUS_IGNORE);
+  out_offset += total;
+}
+
+void query_batch::close() {
+  MPI_File_close(&inputfile);
+  MPI_File_close(&outputfile);
+  std::vector<char>().swap(buf);
+  std::string().swap(out);
+}
+
+bool next_query_file(const std::string &query_arg, uint64_t &served, std::string &filename) {
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  if (query_arg != "-") {
+    filename = query_arg;
+    return served++ == 0;
+  }
+
+  /* PE 0 reads the next non-empty line of stdin, -1 is the end of it */
+  long long len = -1;
+  if (rank == 0) {
+    while (std::getline(std::cin, filename)) {
+      if (!filename.empty() && filename.back() == '\r') filename.pop_back();
+      if (!filename.empty()) {
+        len = filename.size();
+        break;
+      }
+    }
+  }
+
+  MPI_Bcast(&len, 1, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+  if (len < 0) return false;
+
+  filename.resize(len);
+  MPI_Bcast(&filename[0], static_cast<int>(len), MPI_CHAR, 0, MPI_COMM_WORLD);
+  served++;
+  return true;
+}
@@ -0,0 +1,62 @@
+#ifndef QUERY_BATCH_H
+#define QUERY_BATCH_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <mpi.h>
+
+#include "common.hpp"
+
+/*
+ * A batch of k-mer queries: a text file with one k-mer per line. Its
+ * answers go to <file>.counts, one count per line in the same order as
+ * the queries (0 for absent k-mers and for lines that are not a k-mer).
+ *
+ * The file is answered in rounds: every round covers the next
+ * npes x round_size bytes, and each PE takes the lines starting in its
+ * round_size slice of them. The answers of a round, concatenated in PE
+ * order, thus follow the query order, and the memory held per batch is
+ * bounded no matter how large it is. All calls except the constructor
+ * are collective, and every PE takes part in the same number of rounds.
+ */
+class query_batch {
+public:
+  std::string filename, out_filename;
+  uint64_t numqueries = 0; // lines answered by this PE
+
+  query_batch(const std::string &filename, uint64_t round_size);
+
+  // false (on all PEs) if the file can not be opened
+  bool open();
+
+  // the complete lines of this PE's next round, false once all PEs are done
+  bool next_round(const char* &data, uint64_t &len);
+
+  // writes one count per line of the last round
+  void write_counts(const std::vector<count_t> &counts);
+
+  void close();
+
+private:
+  MPI_File inputfile, outputfile;
+  MPI_Offset filesize, round_start = 0;
+  MPI_Offset out_offset = 0;
+  int rank, npes;
+  uint64_t round_size;
+  std::vector<char> buf;
+  std::string out;
+
+  MPI_Offset find_line_start(MPI_Offset from, MPI_Offset filesize);
+};
+
+/*
+ * Collective: the next query file to answer. A query argument of "-"
+ * keeps the service resident: PE 0 reads one query file name per line
+ * from standard input until it is closed. Any other argument is a single
+ * query file.
+ */
+bool next_query_file(const std::string &query_arg, uint64_t &served, std::string &filename);
+
+#endif
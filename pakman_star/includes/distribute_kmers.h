@@ -875,6 +875,8 @@ int compare (const void * a, const void * b);
 int FindIndex( const int a[], int size, int value);
 char* DivideReads(MPI_File *in, const int rank, const int size, 
         const int overlap, uint64_t *nlines, size_t *data_size);
+char* DivideCompressedReads(MPI_File *in, const int rank, const int size,
+        uint64_t *nlines, size_t *data_size);
 //input_read_data perform_input_reading (const int rank, 
 //        const int size, char *argv[]);
 input_read_data perform_input_reading (const int rank, const int size,
@@ -56,6 +56,7 @@
 #include <parallel/algorithm>
 #include <numeric>
 #include <omp.h>
+#include <zlib.h>
 #include "distribute_kmers.h"
 
 
@@ -230,6 +231,229 @@ char* DivideReads(MPI_File *in, const int rank, const int size, const int overla
 }
 
 
+/*
+ * Compressed input. A BGZF file (bgzip output) is a series of gzip members
+ * of at most 64KB, each with its compressed size in a 'BC' extra field and
+ * its decompressed size in the last 4 bytes, so every process can inflate
+ * the blocks that start in its byte range on its own. A plain gzip stream
+ * can only be inflated from the start, so process 0 inflates it and
+ * scatters the reads.
+ */
+#define BGZF_MAX_BLOCK 65536
+
+static long bgzf_block_size(const unsigned char *buf, size_t len) {
+    if (len < 18) return -1;
+    if (buf[0] != 0x1f || buf[1] != 0x8b || buf[2] != 8 || !(buf[3] & 0x4)) return -1;
+
+    size_t xlen = buf[10] | (buf[11] << 8);
+    if (len < 12 + xlen) return -1;
+
+    for (size_t pos = 12; pos + 4 <= 12 + xlen; ) {
+        size_t slen = buf[pos + 2] | (buf[pos + 3] << 8);
+        if (buf[pos] == 'B' && buf[pos + 1] == 'C' && slen == 2 && pos + 6 <= 12 + xlen)
+            return (buf[pos + 4] | (buf[pos + 5] << 8)) + 1;
+        pos += 4 + slen;
+    }
+    return -1;
+}
+
+/* first block at or after 'from' whose successor is a valid block too */
+static MPI_Offset find_bgzf_block(MPI_File *in, MPI_Offset from, MPI_Offset filesize) {
+    if (from <= 0) return 0;
+    if (from >= filesize) return filesize;
+
+    MPI_Offset len = std::min<MPI_Offset>(3 * BGZF_MAX_BLOCK, filesize - from);
+    std::vector<unsigned char> buf(len);
+    MPI_File_read_at(*in, from, buf.data(), len, MPI_BYTE, MPI_STATUS_IGNORE);
+
+    for (MPI_Offset pos = 0; pos < len && pos < BGZF_MAX_BLOCK; pos++) {
+        long bs = bgzf_block_size(&buf[pos], len - pos);
+        if (bs < 0) continue;
+        if (from + pos + bs == filesize) return from + pos;
+        if (pos + bs < len && bgzf_block_size(&buf[pos + bs], len - pos - bs) > 0) return from + pos;
+    }
+    return filesize;
+}
+
+static void read_large(MPI_File *in, MPI_Offset offset, char *buf, size_t len) {
+    const size_t piece = 1000000000; // 1GB, MPI counts are ints
+    for (size_t done = 0; done < len; done += piece)
+        MPI_File_read_at(*in, offset + done, &buf[done], (int) std::min(piece, len - done),
+                         MPI_BYTE, MPI_STATUS_IGNORE);
+}
+
+static void send_large(const char *buf, size_t len, int dest) {
+    const size_t piece = 1000000000;
+    uint64_t n = len;
+    MPI_Send(&n, 1, MPI_UINT64_T, dest, 0, MPI_COMM_WORLD);
+    for (size_t done = 0; done < len; done += piece)
+        MPI_Send(&buf[done], (int) std::min(piece, len - done), MPI_BYTE, dest, 0, MPI_COMM_WORLD);
+}
+
+static std::vector<char> recv_large(int src) {
+    const size_t piece = 1000000000;
+    uint64_t n;
+    MPI_Recv(&n, 1, MPI_UINT64_T, src, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    std::vector<char> buf(n);
+    for (size_t done = 0; done < n; done += piece)
+        MPI_Recv(&buf[done], (int) std::min(piece, (size_t) n - done), MPI_BYTE, src, 0,
+                 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    return buf;
+}
+
+static void inflate_bgzf(const unsigned char *cdata, size_t clen, std::vector<char> &out) {
+    /* list the blocks, their sizes give every block its place in 'out' */
+    std::vector<size_t> block_pos, out_pos(1, 0);
+    for (size_t pos = 0; pos < clen; ) {
+        long bs = bgzf_block_size(&cdata[pos], clen - pos);
+        if (bs < 0 || pos + bs > clen) {
+            fprintf(stderr, "Corrupt BGZF block at %lu\n", pos);
+            MPI_Abort(MPI_COMM_WORLD, 2);
+        }
+        uint32_t isize;
+        memcpy(&isize, &cdata[pos + bs - 4], sizeof(isize));
+        block_pos.push_back(pos);
+        out_pos.push_back(out_pos.back() + isize);
+        pos += bs;
+    }
+    out.resize(out_pos.back());
+
+    int nblocks = block_pos.size(), corrupt = 0;
+    #pragma omp parallel for schedule(dynamic, 64) reduction(+:corrupt)
+    for (int b = 0; b < nblocks; b++) {
+        const unsigned char *block = &cdata[block_pos[b]];
+        size_t hdr_len = 12 + (block[10] | (block[11] << 8));
+        long bs = bgzf_block_size(block, clen - block_pos[b]);
+
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        inflateInit2(&zs, -15);
+        zs.next_in = (unsigned char *) &block[hdr_len];
+        zs.avail_in = bs - hdr_len - 8;
+        zs.next_out = (unsigned char *) &out[out_pos[b]];
+        zs.avail_out = out_pos[b + 1] - out_pos[b];
+        if (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.avail_out != 0) corrupt++;
+        inflateEnd(&zs);
+    }
+
+    if (corrupt) {
+        fprintf(stderr, "Could not inflate %d BGZF blocks\n", corrupt);
+        MPI_Abort(MPI_COMM_WORLD, 2);
+    }
+}
+
+static void inflate_gzip(const unsigned char *cdata, size_t clen, std::vector<char> &out) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    inflateInit2(&zs, 15 + 16);
+    zs.next_in = (unsigned char *) cdata;
+    zs.avail_in = clen;
+
+    size_t filled = 0;
+    int ret = Z_OK;
+    out.resize(std::max<size_t>(4 * clen, BGZF_MAX_BLOCK));
+
+    while (zs.avail_in > 0) {
+        if (filled == out.size()) out.resize(2 * out.size());
+        zs.next_out = (unsigned char *) &out[filled];
+        zs.avail_out = out.size() - filled;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        filled = out.size() - zs.avail_out;
+        if (ret == Z_STREAM_END) inflateReset(&zs); /* concatenated members */
+        else if (ret != Z_OK && ret != Z_BUF_ERROR) break;
+    }
+    inflateEnd(&zs);
+
+    if (ret != Z_STREAM_END) {
+        fprintf(stderr, "Corrupt or truncated gzip input\n");
+        MPI_Abort(MPI_COMM_WORLD, 2);
+    }
+    out.resize(filled);
+}
+
+char* DivideCompressedReads(MPI_File *in, const int rank, const int size,
+                            uint64_t *nlines, size_t *data_size) {
+    MPI_Offset filesize, start, end;
+    std::vector<char> data, suffix;
+    unsigned char hdr[64];
+
+    MPI_File_get_size(*in, &filesize);
+    MPI_Offset hdr_len = std::min<MPI_Offset>(sizeof(hdr), filesize);
+    MPI_File_read_at(*in, 0, hdr, hdr_len, MPI_BYTE, MPI_STATUS_IGNORE);
+    bool is_bgzf = (bgzf_block_size(hdr, hdr_len) > 0);
+
+    if (rank == 0) fprintf (stderr, "Compressed input (%s)\n", is_bgzf ? "BGZF" : "plain gzip");
+
+    if (is_bgzf) {
+        /* everyone inflates the blocks that start in its part of the file */
+        start = find_bgzf_block(in, rank * (filesize / size), filesize);
+        std::vector<MPI_Offset> starts(size);
+        MPI_Allgather(&start, 1, MPI_OFFSET, starts.data(), 1, MPI_OFFSET, MPI_COMM_WORLD);
+        end = (rank == size - 1) ? filesize : starts[rank + 1];
+
+        std::vector<unsigned char> cdata(end - start);
+        read_large(in, start, (char *) cdata.data(), cdata.size());
+        inflate_bgzf(cdata.data(), cdata.size(), data);
+
+        /*
+         * the bytes before the first '>' end the previous process' last
+         * read; without any '>' everything (and whatever the next process
+         * hands over) belongs to it
+         */
+        size_t skip = 0;
+        if (rank != 0) {
+            while (skip < data.size() && data[skip] != '>') skip++;
+        }
+        bool has_start = (skip < data.size()) || rank == 0;
+
+        if (rank != 0 && has_start) send_large(data.data(), skip, rank - 1);
+        if (rank != size - 1) suffix = recv_large(rank + 1);
+        if (rank != 0 && !has_start) {
+            data.insert(data.end(), suffix.begin(), suffix.end());
+            send_large(data.data(), data.size(), rank - 1);
+            data.clear();
+            suffix.clear();
+        }
+
+        data.erase(data.begin(), data.begin() + std::min(skip, data.size()));
+        data.insert(data.end(), suffix.begin(), suffix.end());
+    } else {
+        /* process 0 inflates everything and cuts it at '>' into one part per process */
+        if (rank == 0) {
+            std::vector<unsigned char> cdata(filesize);
+            read_large(in, 0, (char *) cdata.data(), cdata.size());
+            std::vector<char> all;
+            inflate_gzip(cdata.data(), cdata.size(), all);
+
+            size_t prev = 0;
+            for (int r = 0; r < size; r++) {
+                size_t cut = all.size();
+                if (r != size - 1) {
+                    cut = std::max(prev, all.size() / size * (r + 1));
+                    while (cut < all.size() && all[cut] != '>') cut++;
+                }
+                if (r == 0) data.assign(all.begin(), all.begin() + cut);
+                else send_large(&all[prev], cut - prev, r);
+                prev = cut;
+            }
+        } else {
+            data = recv_large(0);
+        }
+    }
+
+    char *chunk = (char *) malloc((data.size() + 1) * sizeof(char));
+    memcpy(chunk, data.data(), data.size());
+    chunk[data.size()] = '\0';
+
+    *nlines = 0;
+    for (size_t i = 0; i < data.size(); i++)
+        if (data[i] == '>') (*nlines)++;
+    *data_size = data.size();
+
+    return chunk;
+}
+
+
 input_read_data perform_input_reading (const int rank, const int size,
                                        std::string &fileName, int read_length)
 {
@@ -255,7 +479,11 @@ input_read_data perform_input_reading (const int rank, const int size,
     if (rank==0)
         fprintf(stderr, "Start Reading the input dataset\n");
         
-    input_rdata.read_data = DivideReads(&in, rank, size, overlap, &nlines, &read_data_size);
+    /* .gz inputs are inflated while reading, no decompressed copy on disk */
+    if (fileName.size() > 3 && fileName.compare(fileName.size() - 3, 3, ".gz") == 0)
+        input_rdata.read_data = DivideCompressedReads(&in, rank, size, &nlines, &read_data_size);
+    else
+        input_rdata.read_data = DivideReads(&in, rank, size, overlap, &nlines, &read_data_size);
     input_rdata.read_data_size = read_data_size;
 
 #ifdef DEBUG_OUT